@@ -1,5 +1,6 @@
 use criterion::{black_box, criterion_group, criterion_main, Criterion};
-use hackvm::{VMEmulator, VMProgram};
+use hackvm::{Framebuffer, LinkedProgram, ScreenChanges, VMEmulator, VMProgram};
+use std::sync::Arc;
 
 pub fn criterion_benchmark(c: &mut Criterion) {
     let program = VMProgram::new(&vec![(
@@ -24,9 +25,23 @@ pub fn criterion_benchmark(c: &mut Criterion) {
         ",
     )])
     .unwrap();
+    let program = Arc::new(LinkedProgram::new(program));
 
     c.bench_function("fib 20", |b| {
-        b.iter(|| VMEmulator::new(program.clone()).run(black_box(2000)))
+        b.iter(|| VMEmulator::with_program(program.clone()).run(black_box(2000)))
+    });
+    c.bench_function("fib 20 threaded", |b| {
+        b.iter(|| VMEmulator::with_program(program.clone()).run_threaded(black_box(2000)))
+    });
+
+    // a full redraw of a screen with a mix of words
+    let screen: Vec<i32> = (0..8192u32)
+        .map(|i| (i.wrapping_mul(2654435761) >> 16) as i32)
+        .collect();
+    let mut framebuffer = Framebuffer::new();
+    let all = ScreenChanges::new();
+    c.bench_function("expand screen", |b| {
+        b.iter(|| framebuffer.update(black_box(&screen), &all))
     });
 }
 
@@ -1,9 +1,20 @@
 #![allow(dead_code)]
 
+mod vmbinary;
+mod vmcache;
+mod vmcapture;
 mod vmcommand;
 mod vmemulator;
+mod vmlinker;
 mod vmparser;
+mod vmprofile;
+mod vmscheduler;
+mod vmscreen;
+mod vmsymbols;
+mod vmthreaded;
+mod vmverifier;
 
+use std::sync::Arc;
 use wasm_bindgen::prelude::*;
 use web_sys::{CanvasRenderingContext2d, ImageData};
 
@@ -13,8 +24,15 @@ use web_sys::{CanvasRenderingContext2d, ImageData};
 #[global_allocator]
 static ALLOC: wee_alloc::WeeAlloc = wee_alloc::WeeAlloc::INIT;
 
+pub use vmcache::ProgramCache;
+pub use vmcapture::{record_frames, screen_to_png, FrameReader, FrameWriter};
 pub use vmcommand::VMProgram;
 pub use vmemulator::VMEmulator;
+pub use vmparser::{StreamedTokens, TokenStream};
+pub use vmprofile::Profile;
+pub use vmscheduler::{Scheduler, SchedulerStats};
+pub use vmscreen::{Framebuffer, Palette, Rect, ScreenChanges, SCREEN_HEIGHT, SCREEN_WIDTH};
+pub use vmthreaded::LinkedProgram;
 
 #[wasm_bindgen]
 pub fn init_panic_hook() {
@@ -28,6 +46,13 @@ pub fn init_panic_hook() {
     console_error_panic_hook::set_once();
 }
 
+/// The module's linear memory, for reading buffers like the framebuffer from
+/// JS without copying them.
+#[wasm_bindgen]
+pub fn wasm_memory() -> JsValue {
+    wasm_bindgen::memory()
+}
+
 #[wasm_bindgen]
 extern "C" {
     // Use `js_namespace` here to bind `console.log(..)` instead of just
@@ -55,7 +80,19 @@ macro_rules! console_log {
 #[wasm_bindgen]
 pub struct WebVM {
     vm: VMEmulator,
-    files: Vec<(String, String)>,
+    files: Vec<(String, StreamedTokens)>,
+    // the file being loaded by load_file_chunk, if any
+    loading: Option<(String, TokenStream)>,
+    profile: Option<Profile>,
+    framebuffer: Framebuffer,
+    framebuffer_generation: u32,
+    // the pixels that changed in the last framebuffer update
+    dirty_rect: Rect,
+    // set when every pixel has to be expanded again, like after a palette change
+    redraw_all: bool,
+    scheduler: Scheduler,
+    // reused by fill_debug_snapshot
+    snapshot: Vec<i32>,
 }
 
 #[wasm_bindgen]
@@ -64,30 +101,150 @@ impl WebVM {
         WebVM {
             vm: VMEmulator::empty(),
             files: Vec::new(),
+            loading: None,
+            profile: None,
+            framebuffer: Framebuffer::new(),
+            framebuffer_generation: 0,
+            dirty_rect: Rect::empty(),
+            redraw_all: false,
+            scheduler: Scheduler::new(),
+            snapshot: Vec::new(),
         }
     }
 
-    pub fn load_file(&mut self, name: &str, content: &str) {
-        self.files.push((name.to_string(), content.to_string()));
+    pub fn load_file(&mut self, name: &str, content: &str) -> Result<(), JsValue> {
+        self.load_file_chunk(name, content)?;
+        self.finish_loading()
     }
 
-    pub fn init(&mut self) -> Result<(), JsValue> {
-        let files: Vec<(&str, &str)> = self.files.iter().map(|(a, b)| (&a[..], &b[..])).collect();
-        let program = VMProgram::with_internals(&files, Some(VMEmulator::get_internals()))
-            .map_err(|e| format!("Failed to parse program: {}", e))?;
+    /// Tokenizes the next piece of a file as it arrives, so that large files
+    /// never need to be held in memory as a whole. A chunk for a different
+    /// file name starts the next file.
+    pub fn load_file_chunk(&mut self, name: &str, chunk: &str) -> Result<(), JsValue> {
+        if self
+            .loading
+            .as_ref()
+            .map_or(false, |(loading, _)| loading != name)
+        {
+            self.finish_loading()?;
+        }
+        let (_, stream) = self
+            .loading
+            .get_or_insert_with(|| (name.to_string(), TokenStream::new()));
+        stream
+            .push(chunk)
+            .map_err(|e| format!("Failed to parse {}: {}", name, e))?;
+        Ok(())
+    }
+
+    fn finish_loading(&mut self) -> Result<(), JsValue> {
+        if let Some((name, stream)) = self.loading.take() {
+            let tokens = stream
+                .finish()
+                .map_err(|e| format!("Failed to parse {}: {}", name, e))?;
+            self.files.push((name, tokens));
+        }
+        Ok(())
+    }
+
+    fn link(&mut self) -> Result<VMProgram, JsValue> {
+        self.finish_loading()?;
+        Ok(VMProgram::link_streams(&self.files)
+            .map_err(|e| format!("Failed to parse program: {}", e))?)
+    }
+
+    /// Lays out a linked program for the emulator, logging any warnings and
+    /// the functions the linker removed.
+    fn prepare(&self, program: VMProgram) -> Arc<LinkedProgram> {
         for warning in program.warnings.iter() {
             console_log!("Warning: {}", warning);
         }
-        let mut vm = VMEmulator::new(program);
+        let dead = &program.dead_functions;
+        if !dead.names.is_empty() {
+            console_log!(
+                "Removed {} unreachable functions ({} commands): {}",
+                dead.names.len(),
+                dead.num_commands,
+                dead.names.join(", ")
+            );
+        }
+        let linked = match &self.profile {
+            Some(profile) => LinkedProgram::with_profile(program, profile),
+            None => LinkedProgram::new(program),
+        };
+        for warning in linked.code.warnings.iter() {
+            console_log!("Warning: {}", warning);
+        }
+        Arc::new(linked)
+    }
+
+    fn start(&mut self, program: VMProgram) -> Result<(), JsValue> {
+        let mut vm = VMEmulator::with_program(self.prepare(program));
         vm.init()
             .map_err(|e| format!("Failed to initialize program: {}", e))?;
         self.vm = vm;
         Ok(())
     }
 
+    pub fn init(&mut self) -> Result<(), JsValue> {
+        let program = self.link()?;
+        self.start(program)
+    }
+
+    /// Replaces one loaded file and relinks the program. Only the new file is
+    /// parsed. The running program keeps its ram and call stack unless that
+    /// can't be done safely, e.g. because a function on the call stack
+    /// changed, in which case it restarts.
+    pub fn reload_file(&mut self, name: &str, content: &str) -> Result<(), JsValue> {
+        self.finish_loading()?;
+        let tokens = StreamedTokens::from_str(content)
+            .map_err(|e| format!("Failed to parse {}: {}", name, e))?;
+        let previous = match self.files.iter().position(|(file, _)| file == name) {
+            Some(index) => Some((index, std::mem::replace(&mut self.files[index].1, tokens))),
+            None => {
+                self.files.push((name.to_string(), tokens));
+                None
+            }
+        };
+        let program = match self.link() {
+            Ok(program) => program,
+            Err(e) => {
+                match previous {
+                    Some((index, old_tokens)) => self.files[index].1 = old_tokens,
+                    // the file is new, so leave it out again
+                    None => {
+                        self.files.pop();
+                    }
+                }
+                return Err(e);
+            }
+        };
+        let linked = self.prepare(program);
+        if let Err(e) = self.vm.reload_program(linked.clone()) {
+            console_log!("Restarting after reloading {}: {}", name, e);
+            let mut vm = VMEmulator::with_program(linked);
+            vm.init()
+                .map_err(|e| format!("Failed to initialize program: {}", e))?;
+            self.vm = vm;
+        }
+        Ok(())
+    }
+
+    /// Links the loaded files into a precompiled program, which can be passed
+    /// to `init_precompiled` later instead of loading the files again.
+    pub fn precompile(&mut self) -> Result<Vec<u8>, JsValue> {
+        Ok(self.link()?.to_bytes())
+    }
+
+    pub fn init_precompiled(&mut self, bytes: &[u8]) -> Result<(), JsValue> {
+        let program = VMProgram::from_bytes(bytes)
+            .map_err(|e| format!("Failed to load precompiled program: {}", e))?;
+        self.start(program)
+    }
+
     pub fn tick(&mut self, n: i32) -> Result<(), JsValue> {
         for _ in 0..n {
-            match self.vm.step() {
+            match self.vm.step_threaded() {
                 Err(e) => return Err(JsValue::from(e)),
                 Ok(_) => {}
             };
@@ -98,7 +255,7 @@ impl WebVM {
     pub fn tick_profiled(&mut self, n: i32) -> Result<(), JsValue> {
         for _ in 0..n {
             self.vm.profile_step();
-            match self.vm.step() {
+            match self.vm.step_threaded() {
                 Err(e) => return Err(JsValue::from(e)),
                 Ok(_) => {}
             };
@@ -106,6 +263,40 @@ impl WebVM {
         Ok(())
     }
 
+    /// Sets the speed `run_slice` aims for in steps per second, or lets it
+    /// run as fast as its time budget allows if `steps_per_second` is 0.
+    pub fn set_target_speed(&mut self, steps_per_second: f64) {
+        self.scheduler
+            .set_target_speed(Some(steps_per_second).filter(|speed| *speed > 0.0));
+    }
+
+    /// Runs as many steps as fit in `budget_ms` at the target speed, and
+    /// returns how many it ran. `now` is the time in milliseconds, like
+    /// `performance.now()`, and `end_slice` has to be called with the time
+    /// once this returns, to measure how fast the steps ran.
+    pub fn run_slice(&mut self, now: f64, budget_ms: f64) -> Result<u32, JsValue> {
+        let steps = self.scheduler.start_slice(now, budget_ms);
+        self.tick(steps as i32)?;
+        Ok(steps as u32)
+    }
+
+    pub fn end_slice(&mut self, now: f64) {
+        self.scheduler.end_slice(now);
+    }
+
+    /// The speed achieved by `run_slice` over the last half second or so.
+    pub fn steps_per_second(&self) -> f64 {
+        self.scheduler.stats().steps_per_second
+    }
+
+    pub fn average_slice_ms(&self) -> f64 {
+        self.scheduler.stats().average_slice_ms
+    }
+
+    pub fn max_slice_ms(&self) -> f64 {
+        self.scheduler.stats().max_slice_ms
+    }
+
     pub fn set_keyboard(&mut self, key: u16) -> Result<(), JsValue> {
         match self.vm.set_ram(24576, key as i32) {
             Err(e) => Err(JsValue::from(e)),
@@ -121,58 +312,147 @@ impl WebVM {
         self.vm.reset();
     }
 
+    /// Draws the screen, expanding only the words written since the last
+    /// frame and putting only the rectangle around them on the canvas, which
+    /// has to still show the previous frame. Nothing is drawn if the screen
+    /// didn't change.
     pub fn draw_screen(&mut self, ctx: &CanvasRenderingContext2d) -> Result<(), JsValue> {
-        let start = 16384;
-        let end = start + 512 * 256 / 16;
-        let ram = self.vm.get_ram_range(start, end);
-        draw_from_ram(ram, ctx)
+        let generation = self.framebuffer_generation;
+        if self.update_framebuffer() != generation {
+            draw_framebuffer(&mut self.framebuffer, self.dirty_rect, ctx)?;
+        }
+        Ok(())
+    }
+
+    /// Expands the screen words written since the last update into the
+    /// framebuffer, and returns the framebuffer generation, which changes
+    /// whenever the pixels do.
+    pub fn update_framebuffer(&mut self) -> u32 {
+        if !self.screen_changed() {
+            self.dirty_rect = Rect::empty();
+            return self.framebuffer_generation;
+        }
+        let mut changes = self.vm.take_screen_changes();
+        if std::mem::take(&mut self.redraw_all) {
+            changes = ScreenChanges::new();
+        }
+        self.dirty_rect = match self.framebuffer.update(self.vm.screen(), &changes) {
+            Some(rect) => {
+                self.framebuffer_generation = self.framebuffer_generation.wrapping_add(1);
+                rect
+            }
+            None => Rect::empty(),
+        };
+        self.framebuffer_generation
+    }
+
+    /// Whether the next `update_framebuffer` has anything to do. Checking
+    /// this first lets a renderer skip frames where the screen is unchanged.
+    pub fn screen_changed(&self) -> bool {
+        self.redraw_all || self.vm.screen_changed()
+    }
+
+    /// The pixels that changed in the last `update_framebuffer`, for the
+    /// dirty rectangle arguments of `putImageData`.
+    pub fn dirty_x(&self) -> usize {
+        self.dirty_rect.x
+    }
+
+    pub fn dirty_y(&self) -> usize {
+        self.dirty_rect.y
+    }
+
+    pub fn dirty_width(&self) -> usize {
+        self.dirty_rect.width
+    }
+
+    pub fn dirty_height(&self) -> usize {
+        self.dirty_rect.height
+    }
+
+    /// Where the framebuffer's RGBA pixels start in `wasm_memory()`. The
+    /// framebuffer never moves, but views of it have to be recreated when
+    /// the memory grows.
+    pub fn framebuffer_ptr(&self) -> *const u8 {
+        self.framebuffer.pixels().as_ptr()
+    }
+
+    pub fn framebuffer_len(&self) -> usize {
+        self.framebuffer.pixels().len()
+    }
+
+    /// Sets the colours of clear and set screen bits, each given as
+    /// 0xRRGGBBAA, and redraws the whole screen in them on the next update.
+    pub fn set_palette(&mut self, background: u32, foreground: u32) {
+        self.framebuffer.set_palette(Palette {
+            background: background.to_be_bytes(),
+            foreground: foreground.to_be_bytes(),
+        });
+        self.redraw_all = true;
     }
 
     pub fn get_stats(&self) -> JsValue {
         JsValue::from(format!("Stats: \n{}", self.vm.profiler_stats()))
     }
 
+    /// Returns the profile collected by `tick_profiled`, in a form that can be
+    /// passed to `set_profile` on a later run of the same program.
+    pub fn get_profile(&self) -> String {
+        self.vm.profile().to_text()
+    }
+
+    /// Lays out the code by the given profile the next time the program is
+    /// initialized.
+    pub fn set_profile(&mut self, profile: &str) -> Result<(), JsValue> {
+        let profile =
+            Profile::from_text(profile).map_err(|e| format!("Failed to load profile: {}", e))?;
+        self.profile = Some(profile);
+        Ok(())
+    }
+
     pub fn get_debug(&self) -> JsValue {
         JsValue::from(self.vm.debug())
     }
-}
 
-fn pixels_from_ram(ram: &[i32]) -> Vec<u8> {
-    let mut data = Vec::new();
-    for a in ram.iter() {
-        if *a == 0 {
-            for _ in 0..16 * 4 {
-                data.push(0xff); // white
-            }
-        } else {
-            for i in 0..16 {
-                if a & 1 << i > 0 {
-                    data.push(0x00);
-                    data.push(0x00);
-                    data.push(0x00);
-                    data.push(0xff);
-                } else {
-                    data.push(0xff);
-                    data.push(0xff);
-                    data.push(0xff);
-                    data.push(0xff);
-                }
-            }
+    /// Fills `out` with the numbers of `VMEmulator::debug_snapshot` and
+    /// returns how many there are. If `out` is too short for them, nothing is
+    /// written, and the caller should retry with an array of that length.
+    pub fn fill_debug_snapshot(&mut self, out: &mut [i32]) -> usize {
+        self.vm.debug_snapshot(&mut self.snapshot);
+        if let Some(out) = out.get_mut(..self.snapshot.len()) {
+            out.copy_from_slice(&self.snapshot);
         }
+        self.snapshot.len()
     }
-    data
-}
 
-fn draw_from_ram(ram: &[i32], ctx: &CanvasRenderingContext2d) -> Result<(), JsValue> {
-    let mut data = pixels_from_ram(ram);
+    /// The names of the functions numbered in debug snapshots, one per line.
+    /// They only change when the program is linked again.
+    pub fn function_names(&self) -> String {
+        self.vm.function_names().join("\n")
+    }
 
-    let width = 512;
-    let height = 256;
+    pub fn next_command(&self) -> Option<String> {
+        self.vm.next_command_text()
+    }
+}
 
+fn draw_framebuffer(
+    framebuffer: &mut Framebuffer,
+    dirty: Rect,
+    ctx: &CanvasRenderingContext2d,
+) -> Result<(), JsValue> {
     let data = ImageData::new_with_u8_clamped_array_and_sh(
-        wasm_bindgen::Clamped(&mut data),
-        width,
-        height,
+        wasm_bindgen::Clamped(framebuffer.pixels_mut()),
+        SCREEN_WIDTH as u32,
+        SCREEN_HEIGHT as u32,
     )?;
-    ctx.put_image_data(&data, 0.0, 0.0)
+    ctx.put_image_data_with_dirty_x_and_dirty_y_and_dirty_width_and_dirty_height(
+        &data,
+        0.0,
+        0.0,
+        dirty.x as f64,
+        dirty.y as f64,
+        dirty.width as f64,
+        dirty.height as f64,
+    )
 }
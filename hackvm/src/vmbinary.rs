@@ -0,0 +1,624 @@
+use super::vmcommand::{check_segment_index, MAX_STATICS};
+use super::vmcommand::{
+    Command, FunctionRef, InlinedCall, Operation, Segment, VMFile, VMFunction, VMProgram,
+};
+use super::vmemulator::VMEmulator;
+use super::vmlinker::DeadFunctions;
+use super::vmsymbols::FunctionTable;
+use std::convert::TryFrom;
+
+/// Precompiled programs start with these bytes.
+pub const MAGIC: &[u8; 4] = b"HVMB";
+/// Bumped whenever the layout below changes. Older or newer bundles are
+/// rejected rather than misread.
+pub const FORMAT_VERSION: u32 = 2;
+const HEADER_SIZE: usize = 16;
+
+// Layout, all integers little endian:
+//
+//   header:   magic[4] version:u32 payload_len:u32 checksum:u32
+//   payload:  functions:u32 { name:str ref:u32 }
+//             files:u32 { name:str num_statics:u32 static_offset:u32
+//                         functions:u32 { name:str id:u32 num_locals:u32
+//                                         commands:u32 { command:[u8; 8] }
+//                                         inlined:u32 { start:u32 end:u32 ref:u32 } } }
+//             warnings:u32 { str }
+//             dead_functions:u32 { name:str } dead_commands:u32
+//
+// Strings are a u32 byte length followed by utf-8. Function refs pack the
+// file index into the high 16 bits and the function index into the low 16
+// bits, with file 0xffff standing for internal functions. Every command is
+// one fixed size record, see `Writer::command`.
+
+const INTERNAL_FILE: u32 = 0xffff;
+
+fn encode_ref(func_ref: FunctionRef) -> u32 {
+    match func_ref {
+        FunctionRef::Internal(index) => INTERNAL_FILE << 16 | index as u32,
+        FunctionRef::InCode(in_code_ref) => {
+            (in_code_ref.file_index() as u32) << 16 | in_code_ref.function_index() as u32
+        }
+    }
+}
+
+fn decode_ref(value: u32) -> FunctionRef {
+    let (file_index, index) = ((value >> 16) as usize, (value & 0xffff) as usize);
+    if file_index == INTERNAL_FILE as usize {
+        FunctionRef::Internal(index)
+    } else {
+        FunctionRef::new(file_index, index)
+    }
+}
+
+const SEGMENTS: [Segment; 8] = [
+    Segment::Constant,
+    Segment::Argument,
+    Segment::Local,
+    Segment::Static,
+    Segment::This,
+    Segment::That,
+    Segment::Pointer,
+    Segment::Temp,
+];
+
+const OPERATIONS: [Operation; 9] = [
+    Operation::Neg,
+    Operation::Not,
+    Operation::Add,
+    Operation::Sub,
+    Operation::And,
+    Operation::Or,
+    Operation::Eq,
+    Operation::Lt,
+    Operation::Gt,
+];
+
+fn segment_code(segment: Segment) -> u8 {
+    SEGMENTS.iter().position(|s| *s == segment).unwrap() as u8
+}
+
+fn fnv1a(bytes: &[u8]) -> u32 {
+    let mut hash: u32 = 0x811c9dc5;
+    for byte in bytes {
+        hash ^= *byte as u32;
+        hash = hash.wrapping_mul(0x01000193);
+    }
+    hash
+}
+
+/// Repeats the checks the text loader makes on a decoded program, so that a
+/// corrupt or hand made bundle can't make the emulator jump out of a function
+/// or index past a segment. Calls to missing functions are let through, since
+/// the text loader keeps those too and they trap when they run.
+fn check_program(program: &VMProgram) -> Result<(), String> {
+    let exists = |func_ref: FunctionRef| match func_ref {
+        FunctionRef::Internal(index) => VMEmulator::internal_num_args(index).is_some(),
+        FunctionRef::InCode(in_code_ref) => program
+            .files
+            .get(in_code_ref.file_index())
+            .map_or(false, |file| {
+                in_code_ref.function_index() < file.functions.len()
+            }),
+    };
+    for (name, func_ref) in program.function_table.iter() {
+        if !exists(func_ref) {
+            return Err(format!("{} refers to a function that doesn't exist", name));
+        }
+    }
+    for (file_index, file) in program.files.iter().enumerate() {
+        let static_end = file.static_offset.checked_add(file.num_statics);
+        if static_end.map_or(true, |end| end > MAX_STATICS) {
+            return Err(format!(
+                "{} has statics past the end of the static segment",
+                file.name
+            ));
+        }
+        for (function_index, function) in file.functions.iter().enumerate() {
+            let name = &function.name;
+            // functions that implement an internal one keep its id
+            let own_id = match function.id {
+                FunctionRef::Internal(_) => exists(function.id),
+                id => id == FunctionRef::new(file_index, function_index),
+            };
+            if !own_id {
+                return Err(format!("{} has the wrong function id", name));
+            }
+            let num_locals = u16::try_from(function.num_locals)
+                .map_err(|_| format!("{} has too many locals", name))?;
+            let check_index = |segment: Segment, index: u16| {
+                check_segment_index(segment, index, num_locals)?;
+                if segment == Segment::Static && index as usize >= file.num_statics {
+                    return Err(format!("Static index {} is out of bounds", index));
+                }
+                Ok(())
+            };
+            for (i, command) in function.commands.iter().enumerate() {
+                let checked = match *command {
+                    Command::Push(segment, index) | Command::Pop(segment, index) => {
+                        check_index(segment, index)
+                    }
+                    Command::CopySeg {
+                        from_segment,
+                        from_index,
+                        to_segment,
+                        to_index,
+                    } => check_index(from_segment, from_index)
+                        .and_then(|_| check_index(to_segment, to_index)),
+                    Command::Goto(target) | Command::If(target)
+                        if target >= function.commands.len() =>
+                    {
+                        Err(format!(
+                            "jump to {} is past the end of the function",
+                            target
+                        ))
+                    }
+                    Command::Function(_, locals) if locals != num_locals => Err(format!(
+                        "function has {} locals instead of {}",
+                        locals, num_locals
+                    )),
+                    Command::Call(FunctionRef::Internal(index), num_args)
+                    | Command::TailCall(FunctionRef::Internal(index), num_args)
+                        if VMEmulator::internal_num_args(index) != Some(num_args as usize) =>
+                    {
+                        Err(format!("call to internal function {} is invalid", index))
+                    }
+                    _ => Ok(()),
+                };
+                checked.map_err(|e| format!("{} at {}: {}", name, i, e))?;
+            }
+            for call in function.inlined.iter() {
+                if call.start > call.end
+                    || call.end > function.commands.len()
+                    || !exists(call.function)
+                {
+                    return Err(format!("{} has an invalid inlined call", name));
+                }
+            }
+        }
+    }
+    Ok(())
+}
+
+struct Writer {
+    bytes: Vec<u8>,
+}
+
+impl Writer {
+    fn u32(&mut self, value: u32) {
+        self.bytes.extend_from_slice(&value.to_le_bytes());
+    }
+
+    fn len(&mut self, value: usize) {
+        self.u32(value as u32);
+    }
+
+    fn str(&mut self, value: &str) {
+        self.len(value.len());
+        self.bytes.extend_from_slice(value.as_bytes());
+    }
+
+    /// Writes a command as an 8 byte record: kind, a byte operand, a u16
+    /// operand and a u32 operand.
+    fn command(&mut self, command: &Command) {
+        let (kind, x, y, z): (u8, u8, u16, u32) = match *command {
+            Command::Arithmetic(op) => (
+                0,
+                OPERATIONS.iter().position(|o| *o == op).unwrap() as u8,
+                0,
+                0,
+            ),
+            Command::Push(segment, index) => (1, segment_code(segment), index, 0),
+            Command::Pop(segment, index) => (2, segment_code(segment), index, 0),
+            Command::If(target) => (3, 0, 0, target as u32),
+            Command::Goto(target) => (4, 0, 0, target as u32),
+            Command::Function(func_ref, num_locals) => (5, 0, num_locals, encode_ref(func_ref)),
+            Command::Return => (6, 0, 0, 0),
+            Command::Call(func_ref, num_args) => (7, 0, num_args, encode_ref(func_ref)),
+            Command::TailCall(func_ref, num_args) => (8, 0, num_args, encode_ref(func_ref)),
+            Command::CopySeg {
+                from_segment,
+                from_index,
+                to_segment,
+                to_index,
+            } => (
+                9,
+                segment_code(from_segment) | segment_code(to_segment) << 4,
+                from_index,
+                to_index as u32,
+            ),
+        };
+        self.bytes.push(kind);
+        self.bytes.push(x);
+        self.bytes.extend_from_slice(&y.to_le_bytes());
+        self.u32(z);
+    }
+}
+
+struct Reader<'a> {
+    bytes: &'a [u8],
+    offset: usize,
+}
+
+impl<'a> Reader<'a> {
+    fn take(&mut self, n: usize) -> Result<&'a [u8], String> {
+        let end = self
+            .offset
+            .checked_add(n)
+            .filter(|end| *end <= self.bytes.len());
+        match end {
+            Some(end) => {
+                let bytes = &self.bytes[self.offset..end];
+                self.offset = end;
+                Ok(bytes)
+            }
+            None => Err(format!("unexpected end of data at byte {}", self.offset)),
+        }
+    }
+
+    fn u32(&mut self) -> Result<u32, String> {
+        let mut value = [0; 4];
+        value.copy_from_slice(self.take(4)?);
+        Ok(u32::from_le_bytes(value))
+    }
+
+    fn len(&mut self) -> Result<usize, String> {
+        self.u32().map(|value| value as usize)
+    }
+
+    /// Reads the number of records that follow, checking that there is room
+    /// for them so that corrupt counts can't cause huge allocations.
+    fn count(&mut self, min_record_size: usize) -> Result<usize, String> {
+        let count = self.len()?;
+        if count.saturating_mul(min_record_size) > self.bytes.len() - self.offset {
+            return Err(format!("record count {} is too large", count));
+        }
+        Ok(count)
+    }
+
+    fn str(&mut self) -> Result<&'a str, String> {
+        let len = self.len()?;
+        std::str::from_utf8(self.take(len)?).map_err(|e| format!("invalid string: {}", e))
+    }
+
+    fn command(&mut self) -> Result<Command, String> {
+        let record = self.take(8)?;
+        let (kind, x) = (record[0], record[1]);
+        let y = u16::from_le_bytes([record[2], record[3]]);
+        let z = u32::from_le_bytes([record[4], record[5], record[6], record[7]]);
+        let segment = |code: u8| {
+            SEGMENTS
+                .get(code as usize)
+                .copied()
+                .ok_or_else(|| format!("invalid segment {}", code))
+        };
+        Ok(match kind {
+            0 => Command::Arithmetic(
+                *OPERATIONS
+                    .get(x as usize)
+                    .ok_or_else(|| format!("invalid operation {}", x))?,
+            ),
+            1 => Command::Push(segment(x)?, y),
+            2 => Command::Pop(segment(x)?, y),
+            3 => Command::If(z as usize),
+            4 => Command::Goto(z as usize),
+            5 => Command::Function(decode_ref(z), y),
+            6 => Command::Return,
+            7 => Command::Call(decode_ref(z), y),
+            8 => Command::TailCall(decode_ref(z), y),
+            9 => Command::CopySeg {
+                from_segment: segment(x & 0xf)?,
+                from_index: y,
+                to_segment: segment(x >> 4)?,
+                to_index: z as u16,
+            },
+            _ => return Err(format!("invalid command kind {}", kind)),
+        })
+    }
+}
+
+impl VMProgram {
+    /// Serializes the linked program so that it can be loaded later with
+    /// `from_bytes` without parsing or linking the vm code again.
+    pub fn to_bytes(&self) -> Vec<u8> {
+        let mut w = Writer {
+            bytes: vec![0; HEADER_SIZE],
+        };
+        let functions: Vec<(&str, FunctionRef)> = self.function_table.iter().collect();
+        w.len(functions.len());
+        for (name, func_ref) in functions {
+            w.str(name);
+            w.u32(encode_ref(func_ref));
+        }
+        w.len(self.files.len());
+        for file in self.files.iter() {
+            w.str(&file.name);
+            w.len(file.num_statics);
+            w.len(file.static_offset);
+            w.len(file.functions.len());
+            for function in file.functions.iter() {
+                w.str(&function.name);
+                w.u32(encode_ref(function.id));
+                w.len(function.num_locals);
+                w.len(function.commands.len());
+                for command in function.commands.iter() {
+                    w.command(command);
+                }
+                w.len(function.inlined.len());
+                for call in function.inlined.iter() {
+                    w.len(call.start);
+                    w.len(call.end);
+                    w.u32(encode_ref(call.function));
+                }
+            }
+        }
+        w.len(self.warnings.len());
+        for warning in self.warnings.iter() {
+            w.str(warning);
+        }
+        w.len(self.dead_functions.names.len());
+        for name in self.dead_functions.names.iter() {
+            w.str(name);
+        }
+        w.len(self.dead_functions.num_commands);
+
+        let payload_len = (w.bytes.len() - HEADER_SIZE) as u32;
+        let checksum = fnv1a(&w.bytes[HEADER_SIZE..]);
+        w.bytes[0..4].copy_from_slice(MAGIC);
+        w.bytes[4..8].copy_from_slice(&FORMAT_VERSION.to_le_bytes());
+        w.bytes[8..12].copy_from_slice(&payload_len.to_le_bytes());
+        w.bytes[12..16].copy_from_slice(&checksum.to_le_bytes());
+        w.bytes
+    }
+
+    /// Loads a program written by `to_bytes`. The bytes can come straight from
+    /// a memory mapped file or a browser `ArrayBuffer`, since nothing needs to
+    /// outlive this call.
+    pub fn from_bytes(bytes: &[u8]) -> Result<VMProgram, String> {
+        let mut r = Reader { bytes, offset: 0 };
+        if r.take(4)? != MAGIC {
+            return Err("not a precompiled vm program".to_string());
+        }
+        let version = r.u32()?;
+        if version != FORMAT_VERSION {
+            return Err(format!(
+                "unsupported program format version {}, expected {}",
+                version, FORMAT_VERSION
+            ));
+        }
+        let payload_len = r.len()?;
+        let checksum = r.u32()?;
+        let payload = &bytes[HEADER_SIZE..];
+        if payload.len() != payload_len || fnv1a(payload) != checksum {
+            return Err("precompiled program is corrupt, checksum doesn't match".to_string());
+        }
+
+        let mut function_table = FunctionTable::new();
+        for _ in 0..r.count(8)? {
+            let name = r.str()?;
+            function_table.insert(name, decode_ref(r.u32()?));
+        }
+        let num_files = r.count(16)?;
+        let mut files = Vec::with_capacity(num_files);
+        for _ in 0..num_files {
+            let name = r.str()?.to_string();
+            let num_statics = r.len()?;
+            let static_offset = r.len()?;
+            let num_functions = r.count(20)?;
+            let mut functions = Vec::with_capacity(num_functions);
+            for _ in 0..num_functions {
+                let name = r.str()?.to_string();
+                let id = decode_ref(r.u32()?);
+                let num_locals = r.len()?;
+                let num_commands = r.count(8)?;
+                let mut commands = Vec::with_capacity(num_commands);
+                for _ in 0..num_commands {
+                    commands.push(r.command()?);
+                }
+                let num_inlined = r.count(12)?;
+                let mut inlined = Vec::with_capacity(num_inlined);
+                for _ in 0..num_inlined {
+                    inlined.push(InlinedCall {
+                        start: r.len()?,
+                        end: r.len()?,
+                        function: decode_ref(r.u32()?),
+                    });
+                }
+                functions.push(VMFunction {
+                    id,
+                    name,
+                    num_locals,
+                    commands,
+                    inlined,
+                });
+            }
+            files.push(VMFile {
+                name,
+                functions,
+                num_statics,
+                static_offset,
+            });
+        }
+        let num_warnings = r.count(4)?;
+        let mut warnings = Vec::with_capacity(num_warnings);
+        for _ in 0..num_warnings {
+            warnings.push(r.str()?.into());
+        }
+        let mut dead_functions = DeadFunctions::default();
+        for _ in 0..r.count(4)? {
+            dead_functions.names.push(r.str()?.to_string());
+        }
+        dead_functions.num_commands = r.len()?;
+        let program = VMProgram {
+            files,
+            function_table,
+            warnings,
+            dead_functions,
+        };
+        check_program(&program).map_err(|e| format!("precompiled program is invalid: {}", e))?;
+        Ok(program)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::vmemulator::VMEmulator;
+
+    fn program() -> VMProgram {
+        let mut program = VMProgram::with_internals(
+            &vec![
+                (
+                    "Sys.vm",
+                    "
+                    function Sys.init 1
+                        push constant 6
+                        pop local 0
+                        push local 0
+                        push constant 7
+                        call Math.multiply 2
+                        call Sys.double 1
+                        push static 0
+                        add
+                        call Sys.missing 0
+                    return
+
+                    function Sys.double 0
+                        push argument 0
+                        push argument 0
+                        add
+                    return",
+                ),
+                (
+                    "Main.vm",
+                    "
+                    function Main.set 0
+                        push constant 1
+                        pop static 3
+                        push constant 0
+                    return",
+                ),
+            ],
+            Some(VMEmulator::get_internals()),
+        )
+        .unwrap();
+        program.dead_functions = program.eliminate_dead_functions("Sys.init");
+        program.inline_leaf_functions(16);
+        program
+    }
+
+    #[test]
+    fn test_round_trip() {
+        let program = program();
+        let loaded = VMProgram::from_bytes(&program.to_bytes()).unwrap();
+        assert_eq!(loaded.files.len(), program.files.len());
+        for (a, b) in loaded.files.iter().zip(program.files.iter()) {
+            assert_eq!(
+                (&a.name, a.num_statics, a.static_offset),
+                (&b.name, b.num_statics, b.static_offset)
+            );
+            for (f, g) in a.functions.iter().zip(b.functions.iter()) {
+                assert_eq!((&f.name, f.id, f.num_locals), (&g.name, g.id, g.num_locals));
+                assert_eq!(f.commands, g.commands);
+                assert_eq!(f.inlined, g.inlined);
+            }
+        }
+        for (name, func_ref) in program.function_table.iter() {
+            assert_eq!(loaded.function_table.get(name), Some(func_ref));
+        }
+        assert_eq!(loaded.warnings, program.warnings);
+        assert_eq!(loaded.dead_functions.names, vec!["Main.set"]);
+        assert_eq!(loaded.dead_functions, program.dead_functions);
+        assert_eq!(loaded.to_bytes(), program.to_bytes());
+        // linking the same files again gives the same bytes
+        for _ in 0..8 {
+            assert_eq!(self::program().to_bytes(), program.to_bytes());
+        }
+    }
+
+    #[test]
+    fn test_rejects_bad_data() {
+        let bytes = program().to_bytes();
+        assert!(VMProgram::from_bytes(b"function Sys.init 0")
+            .err()
+            .unwrap()
+            .contains("not a precompiled"));
+
+        let mut corrupt = bytes.clone();
+        let last = corrupt.len() - 1;
+        corrupt[last] ^= 1;
+        assert!(VMProgram::from_bytes(&corrupt)
+            .err()
+            .unwrap()
+            .contains("checksum"));
+
+        let mut future = bytes.clone();
+        future[4] = 3;
+        assert!(VMProgram::from_bytes(&future)
+            .err()
+            .unwrap()
+            .contains("version 3"));
+
+        assert!(VMProgram::from_bytes(&bytes[..bytes.len() - 4]).is_err());
+        assert!(VMProgram::from_bytes(&bytes[..10]).is_err());
+    }
+
+    #[test]
+    fn test_rejects_invalid_programs() {
+        // bundles with a valid checksum that the text loader wouldn't produce
+        let load = |edit: &dyn Fn(&mut VMProgram)| {
+            let mut program = program();
+            edit(&mut program);
+            VMProgram::from_bytes(&program.to_bytes())
+                .err()
+                .unwrap_or_default()
+        };
+        fn commands(program: &mut VMProgram) -> &mut Vec<Command> {
+            &mut program.files[0].functions[0].commands
+        }
+        assert_eq!(load(&|_| {}), "");
+        assert!(load(&|p| commands(p)[1] = Command::Goto(100)).contains("past the end"));
+        assert!(load(&|p| commands(p)[1] = Command::If(100)).contains("past the end"));
+        assert!(
+            load(&|p| commands(p)[1] = Command::Push(Segment::Local, 2)).contains("Local index 2")
+        );
+        assert!(load(&|p| commands(p)[1] = Command::Pop(Segment::Temp, 8)).contains("Temp index 8"));
+        assert!(
+            load(&|p| commands(p)[1] = Command::Push(Segment::Static, 1))
+                .contains("Static index 1")
+        );
+        assert!(load(&|p| commands(p)[1] = Command::CopySeg {
+            from_segment: Segment::Constant,
+            from_index: 1,
+            to_segment: Segment::Pointer,
+            to_index: 2,
+        })
+        .contains("Pointer index 2"));
+        assert!(
+            load(&|p| commands(p)[0] = Command::Function(FunctionRef::new(0, 0), 9))
+                .contains("9 locals")
+        );
+        assert!(
+            load(&|p| commands(p)[1] = Command::Call(FunctionRef::Internal(9), 2))
+                .contains("internal function 9")
+        );
+        assert!(
+            load(&|p| commands(p)[1] = Command::Call(FunctionRef::Internal(0), 1))
+                .contains("internal function 0")
+        );
+        assert!(
+            load(&|p| p.files[0].functions[0].id = FunctionRef::new(0, 1))
+                .contains("wrong function id")
+        );
+        assert!(load(&|p| p.files[1].static_offset = MAX_STATICS).contains("statics"));
+        assert!(load(&|p| {
+            p.function_table.insert("Sys.gone", FunctionRef::new(5, 0));
+        })
+        .contains("Sys.gone"));
+        assert!(load(&|p| p.files[0].functions[0].inlined.push(InlinedCall {
+            start: 2,
+            end: 100,
+            function: FunctionRef::new(0, 1),
+        }))
+        .contains("invalid inlined call"));
+    }
+}
@@ -0,0 +1,276 @@
+use super::vmbinary::FORMAT_VERSION;
+use super::vmcommand::{Command, VMProgram};
+use super::vmlinker::{LINK_VERSION, MAX_INLINE_COMMANDS};
+use super::vmthreaded::{Instruction, LinkedProgram};
+use std::collections::HashMap;
+use std::fs;
+use std::mem;
+use std::path::PathBuf;
+use std::sync::Arc;
+
+/// Identifies a program by the contents of its files.
+type ProgramKey = u128;
+
+/// Hashes the files of a program, along with everything else that affects
+/// how they're linked, with 128 bit FNV-1a.
+fn program_key(files: &[(&str, &str)]) -> ProgramKey {
+    let mut hash: u128 = 0x6c62272e07bb014262b821756295c58d;
+    let mut write = |bytes: &[u8]| {
+        for byte in bytes {
+            hash ^= *byte as u128;
+            hash = hash.wrapping_mul(0x0000000001000000000000000000013b);
+        }
+    };
+    write(&FORMAT_VERSION.to_le_bytes());
+    write(&LINK_VERSION.to_le_bytes());
+    write(&(MAX_INLINE_COMMANDS as u64).to_le_bytes());
+    for (name, content) in files {
+        write(&(name.len() as u64).to_le_bytes());
+        write(name.as_bytes());
+        write(&(content.len() as u64).to_le_bytes());
+        write(content.as_bytes());
+    }
+    hash
+}
+
+/// Roughly how much memory a linked program takes up.
+fn program_size(linked: &LinkedProgram) -> usize {
+    let code = &linked.code;
+    let mut size = mem::size_of::<LinkedProgram>()
+        + code.instructions.len() * mem::size_of::<Instruction>()
+        + mem::size_of_val(&code.functions[..])
+        + mem::size_of_val(&code.depths[..]);
+    for file in linked.program.files.iter() {
+        size += file.name.len();
+        for function in file.functions.iter() {
+            size += function.name.len() * 2
+                + function.commands.len() * mem::size_of::<Command>()
+                + mem::size_of_val(&function.inlined[..]);
+        }
+    }
+    size
+}
+
+struct CacheEntry {
+    program: Arc<LinkedProgram>,
+    size: usize,
+    last_used: u64,
+}
+
+#[derive(Default, PartialEq, Debug, Clone, Copy)]
+pub struct CacheStats {
+    pub memory_hits: usize,
+    pub disk_hits: usize,
+    pub misses: usize,
+}
+
+/// Linked programs keyed by the contents of their files, so that loading the
+/// same files again skips parsing and optimizing them.
+///
+/// Programs are kept in memory up to `capacity` bytes, evicting the least
+/// recently used ones first. With a directory set, programs are also written
+/// there in the precompiled binary format, which outlives the process. Disk
+/// errors only cost a cache miss.
+pub struct ProgramCache {
+    entries: HashMap<ProgramKey, CacheEntry>,
+    capacity: usize,
+    size: usize,
+    clock: u64,
+    directory: Option<PathBuf>,
+    stats: CacheStats,
+}
+
+impl ProgramCache {
+    pub fn new(capacity: usize) -> ProgramCache {
+        ProgramCache {
+            entries: HashMap::new(),
+            capacity,
+            size: 0,
+            clock: 0,
+            directory: None,
+            stats: CacheStats::default(),
+        }
+    }
+
+    pub fn with_directory(capacity: usize, directory: PathBuf) -> ProgramCache {
+        ProgramCache {
+            directory: Some(directory),
+            ..ProgramCache::new(capacity)
+        }
+    }
+
+    pub fn stats(&self) -> CacheStats {
+        self.stats
+    }
+
+    /// Memory used by the programs cached in memory, as estimated when they
+    /// were added.
+    pub fn size(&self) -> usize {
+        self.size
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    /// Returns the linked program for the given files, linking it with
+    /// `VMProgram::link` and building its threaded code if it isn't cached.
+    pub fn get(&mut self, files: &Vec<(&str, &str)>) -> Result<Arc<LinkedProgram>, String> {
+        let key = program_key(files);
+        self.clock += 1;
+        if let Some(entry) = self.entries.get_mut(&key) {
+            entry.last_used = self.clock;
+            self.stats.memory_hits += 1;
+            return Ok(entry.program.clone());
+        }
+
+        let program = match self.read_from_disk(key) {
+            Some(program) => {
+                self.stats.disk_hits += 1;
+                program
+            }
+            None => {
+                self.stats.misses += 1;
+                let program = VMProgram::link(files)?;
+                self.write_to_disk(key, &program);
+                program
+            }
+        };
+        let program = Arc::new(LinkedProgram::new(program));
+        self.insert(key, program.clone());
+        Ok(program)
+    }
+
+    fn insert(&mut self, key: ProgramKey, program: Arc<LinkedProgram>) {
+        let size = program_size(&program);
+        while self.size + size > self.capacity && !self.entries.is_empty() {
+            self.evict_least_recently_used();
+        }
+        if size > self.capacity {
+            return;
+        }
+        self.size += size;
+        self.entries.insert(
+            key,
+            CacheEntry {
+                program,
+                size,
+                last_used: self.clock,
+            },
+        );
+    }
+
+    fn evict_least_recently_used(&mut self) {
+        let oldest = self
+            .entries
+            .iter()
+            .min_by_key(|(_, entry)| entry.last_used)
+            .map(|(key, _)| *key);
+        if let Some(entry) = oldest.and_then(|key| self.entries.remove(&key)) {
+            self.size -= entry.size;
+        }
+    }
+
+    fn path(&self, key: ProgramKey) -> Option<PathBuf> {
+        self.directory
+            .as_ref()
+            .map(|directory| directory.join(format!("{:032x}.hvmb", key)))
+    }
+
+    fn read_from_disk(&self, key: ProgramKey) -> Option<VMProgram> {
+        let bytes = fs::read(self.path(key)?).ok()?;
+        VMProgram::from_bytes(&bytes).ok()
+    }
+
+    fn write_to_disk(&self, key: ProgramKey, program: &VMProgram) {
+        if let Some(path) = self.path(key) {
+            // write to a temporary file first so that concurrent readers
+            // never see a partially written program
+            let temp_path = path.with_extension(format!("{}.tmp", std::process::id()));
+            let written = fs::create_dir_all(path.parent().unwrap())
+                .and_then(|_| fs::write(&temp_path, program.to_bytes()))
+                .and_then(|_| fs::rename(&temp_path, &path));
+            if written.is_err() {
+                let _ = fs::remove_file(&temp_path);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn files(n: u16) -> Vec<(String, String)> {
+        vec![(
+            "Sys.vm".to_string(),
+            format!("function Sys.init 0\npush constant {}\nreturn", n),
+        )]
+    }
+
+    fn get(cache: &mut ProgramCache, files: &Vec<(String, String)>) -> Arc<LinkedProgram> {
+        let files: Vec<(&str, &str)> = files.iter().map(|(a, b)| (&a[..], &b[..])).collect();
+        cache.get(&files).unwrap()
+    }
+
+    #[test]
+    fn test_program_key() {
+        assert_eq!(
+            program_key(&[("Sys.vm", "return")]),
+            program_key(&[("Sys.vm", "return")])
+        );
+        assert_ne!(
+            program_key(&[("Sys.vm", "return")]),
+            program_key(&[("Sys.v", "mreturn")])
+        );
+    }
+
+    #[test]
+    fn test_memory_cache() {
+        let mut cache = ProgramCache::new(1 << 20);
+        let a = get(&mut cache, &files(1));
+        let b = get(&mut cache, &files(2));
+        assert!(Arc::ptr_eq(&a, &get(&mut cache, &files(1))));
+        assert!(!Arc::ptr_eq(&a, &b));
+        assert_eq!(
+            cache.stats(),
+            CacheStats {
+                memory_hits: 1,
+                disk_hits: 0,
+                misses: 2
+            }
+        );
+    }
+
+    #[test]
+    fn test_evicts_least_recently_used() {
+        let size = program_size(&get(&mut ProgramCache::new(1 << 20), &files(1)));
+        let mut cache = ProgramCache::new(size * 2);
+        let a = get(&mut cache, &files(1));
+        get(&mut cache, &files(2));
+        get(&mut cache, &files(1));
+        get(&mut cache, &files(3));
+        assert_eq!(cache.len(), 2);
+        assert!(cache.size() <= size * 2);
+        // files(2) was the least recently used
+        assert!(Arc::ptr_eq(&a, &get(&mut cache, &files(1))));
+        get(&mut cache, &files(2));
+        assert_eq!(cache.stats().misses, 4);
+    }
+
+    #[test]
+    fn test_disk_cache() {
+        let directory = std::env::temp_dir().join(format!("hackvm-cache-{}", std::process::id()));
+        let mut cache = ProgramCache::with_directory(1 << 20, directory.clone());
+        let a = get(&mut cache, &files(1));
+
+        let mut cache = ProgramCache::with_directory(1 << 20, directory.clone());
+        let b = get(&mut cache, &files(1));
+        assert_eq!(cache.stats().disk_hits, 1);
+        assert_eq!(
+            b.program.files[0].functions[0].commands,
+            a.program.files[0].functions[0].commands
+        );
+        fs::remove_dir_all(directory).unwrap();
+    }
+}
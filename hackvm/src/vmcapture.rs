@@ -0,0 +1,465 @@
+use super::vmemulator::VMEmulator;
+use super::vmscreen::{SCREEN_HEIGHT, SCREEN_WIDTH, SCREEN_WORDS, WORDS_PER_ROW};
+
+/// Frame streams start with these bytes.
+pub const MAGIC: &[u8; 4] = b"HVMF";
+pub const FORMAT_VERSION: u8 = 1;
+
+// Layout of a frame stream:
+//
+//   header:  magic[4] version:u8
+//   frames:  { steps:varint runs }
+//
+// `steps` counts the steps since the previous frame, or since the start of
+// the recording for the first one. Each frame is XORed with the previous
+// one, starting from a blank screen, and the resulting words are stored as
+// runs covering all SCREEN_WORDS words:
+//
+//   varint(n << 1)              n words that didn't change
+//   varint(n << 1 | 1) u16[n]   n words to XOR in, little endian
+//
+// A frame that didn't change at all takes four or five bytes (a three byte
+// run plus the steps), and a frame where a ball moved takes a few dozen, so
+// hours of a typical game fit in a few megabytes. Varints are LEB128: seven bits per byte, low bits first.
+
+fn write_varint(bytes: &mut Vec<u8>, mut value: u64) {
+    while value >= 0x80 {
+        bytes.push(value as u8 | 0x80);
+        value >>= 7;
+    }
+    bytes.push(value as u8);
+}
+
+/// Encodes screens into a frame stream.
+pub struct FrameWriter {
+    bytes: Vec<u8>,
+    previous: Vec<u16>,
+    last_step: u64,
+}
+
+impl FrameWriter {
+    pub fn new() -> FrameWriter {
+        let mut bytes = MAGIC.to_vec();
+        bytes.push(FORMAT_VERSION);
+        FrameWriter {
+            bytes,
+            previous: vec![0; SCREEN_WORDS],
+            last_step: 0,
+        }
+    }
+
+    /// Adds the screen as it was at `step`, which can't be before the step
+    /// of the previous frame.
+    pub fn push(&mut self, step: u64, screen: &[i32]) {
+        assert!(step >= self.last_step, "frames have to be pushed in order");
+        write_varint(&mut self.bytes, step - self.last_step);
+        self.last_step = step;
+
+        let mut i = 0;
+        while i < SCREEN_WORDS {
+            let changed = |i: usize| screen[i] as u16 != self.previous[i];
+            let start = i;
+            if changed(i) {
+                // a single unchanged word between changes is cheaper to
+                // store as a zero than as a run of its own
+                while i < SCREEN_WORDS && (changed(i) || i + 1 < SCREEN_WORDS && changed(i + 1)) {
+                    i += 1;
+                }
+                write_varint(&mut self.bytes, ((i - start) << 1 | 1) as u64);
+                for j in start..i {
+                    let delta = screen[j] as u16 ^ self.previous[j];
+                    self.bytes.extend_from_slice(&delta.to_le_bytes());
+                }
+            } else {
+                while i < SCREEN_WORDS && !changed(i) {
+                    i += 1;
+                }
+                write_varint(&mut self.bytes, ((i - start) << 1) as u64);
+            }
+        }
+        for (previous, word) in self.previous.iter_mut().zip(screen.iter()) {
+            *previous = *word as u16;
+        }
+    }
+
+    pub fn bytes(&self) -> &[u8] {
+        &self.bytes
+    }
+
+    pub fn into_bytes(self) -> Vec<u8> {
+        self.bytes
+    }
+}
+
+/// Decodes a frame stream written by `FrameWriter`, one frame at a time.
+pub struct FrameReader<'a> {
+    bytes: &'a [u8],
+    at: usize,
+    screen: Vec<u16>,
+    step: u64,
+}
+
+impl<'a> FrameReader<'a> {
+    pub fn new(bytes: &'a [u8]) -> Result<FrameReader<'a>, String> {
+        if bytes.len() < 5 || &bytes[..4] != MAGIC {
+            return Err("not a frame stream".to_string());
+        }
+        if bytes[4] != FORMAT_VERSION {
+            return Err(format!(
+                "frame stream version {} is not supported, expected {}",
+                bytes[4], FORMAT_VERSION
+            ));
+        }
+        Ok(FrameReader {
+            bytes,
+            at: 5,
+            screen: vec![0; SCREEN_WORDS],
+            step: 0,
+        })
+    }
+
+    fn varint(&mut self) -> Result<u64, String> {
+        let mut value = 0;
+        for shift in (0..64).step_by(7) {
+            let byte = *self
+                .bytes
+                .get(self.at)
+                .ok_or_else(|| "frame stream is truncated".to_string())?;
+            self.at += 1;
+            value |= ((byte & 0x7f) as u64) << shift;
+            if byte & 0x80 == 0 {
+                return Ok(value);
+            }
+        }
+        Err("frame stream has an invalid varint".to_string())
+    }
+
+    /// Decodes the next frame, and returns the step it was captured at, or
+    /// `None` at the end of the stream.
+    pub fn next_frame(&mut self) -> Result<Option<u64>, String> {
+        if self.at == self.bytes.len() {
+            return Ok(None);
+        }
+        self.step += self.varint()?;
+        let mut i = 0;
+        while i < SCREEN_WORDS {
+            let run = self.varint()?;
+            let end = i + (run >> 1) as usize;
+            if end > SCREEN_WORDS {
+                return Err(format!(
+                    "frame stream run overflows the screen at word {}",
+                    i
+                ));
+            }
+            if run & 1 != 0 {
+                let words = self
+                    .bytes
+                    .get(self.at..self.at + (end - i) * 2)
+                    .ok_or_else(|| "frame stream is truncated".to_string())?;
+                for (word, delta) in self.screen[i..end].iter_mut().zip(words.chunks_exact(2)) {
+                    *word ^= u16::from_le_bytes([delta[0], delta[1]]);
+                }
+                self.at += words.len();
+            }
+            i = end;
+        }
+        Ok(Some(self.step))
+    }
+
+    /// The screen words of the frame decoded last.
+    pub fn screen(&self) -> &[u16] {
+        &self.screen
+    }
+}
+
+/// Runs an initialized `vm` for up to `steps` steps, adding a frame every
+/// `interval` steps, and a last one when it stops. Steps are counted from
+/// the start of the recording. Stops early if the program returns.
+pub fn record_frames(
+    vm: &mut VMEmulator,
+    steps: usize,
+    interval: usize,
+    frames: &mut FrameWriter,
+) -> Result<(), String> {
+    if interval == 0 {
+        return Err("frame interval must be at least one step".to_string());
+    }
+    let mut step = 0;
+    let mut pushed = None;
+    while step < steps {
+        let result = vm.step_threaded()?;
+        step += 1;
+        if result.is_some() {
+            break;
+        }
+        if step % interval == 0 {
+            frames.push(step as u64, vm.screen());
+            pushed = Some(step);
+        }
+    }
+    if pushed != Some(step) {
+        frames.push(step as u64, vm.screen());
+    }
+    Ok(())
+}
+
+fn crc32(bytes: &[u8]) -> u32 {
+    let mut crc = !0u32;
+    for byte in bytes {
+        crc ^= *byte as u32;
+        for _ in 0..8 {
+            crc = if crc & 1 != 0 {
+                crc >> 1 ^ 0xedb88320
+            } else {
+                crc >> 1
+            };
+        }
+    }
+    !crc
+}
+
+fn adler32(bytes: &[u8]) -> u32 {
+    let (mut a, mut b) = (1u32, 0u32);
+    for byte in bytes {
+        a = (a + *byte as u32) % 65521;
+        b = (b + a) % 65521;
+    }
+    b << 16 | a
+}
+
+fn png_chunk(png: &mut Vec<u8>, kind: &[u8; 4], data: &[u8]) {
+    png.extend_from_slice(&(data.len() as u32).to_be_bytes());
+    let start = png.len();
+    png.extend_from_slice(kind);
+    png.extend_from_slice(data);
+    let crc = crc32(&png[start..]);
+    png.extend_from_slice(&crc.to_be_bytes());
+}
+
+/// Encodes the screen as a black and white PNG with one bit per pixel. The
+/// image data is stored without compression, which keeps the encoder free of
+/// dependencies and its output byte for byte stable for golden tests.
+pub fn screen_to_png(screen: &[i32]) -> Vec<u8> {
+    let mut rows = Vec::with_capacity(SCREEN_HEIGHT * (1 + SCREEN_WIDTH / 8));
+    for row in screen.chunks_exact(WORDS_PER_ROW) {
+        // no filter
+        rows.push(0);
+        for word in row {
+            // png wants the leftmost pixel in the high bit and 1 for white,
+            // the screen has them the other way around
+            let bits = !(*word as u16).reverse_bits();
+            rows.extend_from_slice(&bits.to_be_bytes());
+        }
+    }
+
+    // a zlib stream of stored deflate blocks
+    let mut zlib = vec![0x78, 0x01];
+    let blocks: Vec<&[u8]> = rows.chunks(0xffff).collect();
+    for (i, block) in blocks.iter().enumerate() {
+        zlib.push((i + 1 == blocks.len()) as u8);
+        zlib.extend_from_slice(&(block.len() as u16).to_le_bytes());
+        zlib.extend_from_slice(&(!(block.len() as u16)).to_le_bytes());
+        zlib.extend_from_slice(block);
+    }
+    zlib.extend_from_slice(&adler32(&rows).to_be_bytes());
+
+    let mut header = Vec::new();
+    header.extend_from_slice(&(SCREEN_WIDTH as u32).to_be_bytes());
+    header.extend_from_slice(&(SCREEN_HEIGHT as u32).to_be_bytes());
+    // bit depth 1, grayscale, deflate, no filters, not interlaced
+    header.extend_from_slice(&[1, 0, 0, 0, 0]);
+
+    let mut png = b"\x89PNG\r\n\x1a\n".to_vec();
+    png_chunk(&mut png, b"IHDR", &header);
+    png_chunk(&mut png, b"IDAT", &zlib);
+    png_chunk(&mut png, b"IEND", &[]);
+    png
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::vmcommand::VMProgram;
+
+    fn screen_with(words: &[(usize, i32)]) -> Vec<i32> {
+        let mut screen = vec![0; SCREEN_WORDS];
+        for (i, word) in words {
+            screen[*i] = *word;
+        }
+        screen
+    }
+
+    #[test]
+    fn test_frame_stream_round_trip() {
+        let screens = vec![
+            screen_with(&[]),
+            screen_with(&[(0, 1), (1, -1), (3, 0x7fff), (SCREEN_WORDS - 1, -32768)]),
+            screen_with(&[(0, 1), (2, 5), (3, 0x7fff), (100, 9)]),
+            screen_with(&[(0, 1), (2, 5), (3, 0x7fff), (100, 9)]),
+            (0..SCREEN_WORDS as i32)
+                .map(|i| i * 7919 % 65536 - 32768)
+                .collect(),
+        ];
+        let mut writer = FrameWriter::new();
+        for (i, screen) in screens.iter().enumerate() {
+            writer.push(i as u64 * 1000, screen);
+        }
+        let bytes = writer.into_bytes();
+
+        let mut reader = FrameReader::new(&bytes).unwrap();
+        for (i, screen) in screens.iter().enumerate() {
+            assert_eq!(reader.next_frame(), Ok(Some(i as u64 * 1000)));
+            let expected: Vec<u16> = screen.iter().map(|word| *word as u16).collect();
+            assert_eq!(reader.screen(), &expected[..], "frame {}", i);
+        }
+        assert_eq!(reader.next_frame(), Ok(None));
+
+        assert!(FrameReader::new(b"HVMB\x01").is_err());
+        assert!(FrameReader::new(b"HVMF\x02").is_err());
+        let mut truncated = FrameReader::new(&bytes[..bytes.len() - 1]).unwrap();
+        let results: Vec<_> = std::iter::from_fn(|| Some(truncated.next_frame()))
+            .take(screens.len())
+            .collect();
+        assert!(results.last().unwrap().is_err());
+    }
+
+    #[test]
+    fn test_unchanged_frames_are_small() {
+        let mut writer = FrameWriter::new();
+        let mut screen = screen_with(&[(40, 3)]);
+        for step in 0..1000 {
+            // a small sprite moving every tenth frame
+            if step % 10 == 0 {
+                screen[40 + step / 10] = 0;
+                screen[41 + step / 10] = 3;
+            }
+            writer.push(step as u64 * 3000, &screen);
+        }
+        assert!(
+            writer.bytes().len() < 6000,
+            "{} bytes",
+            writer.bytes().len()
+        );
+    }
+
+    // decodes the pngs written by screen_to_png, which only use stored blocks
+    fn png_to_screen(png: &[u8]) -> Vec<i32> {
+        assert_eq!(&png[..8], b"\x89PNG\r\n\x1a\n");
+        let mut at = 8;
+        let mut zlib = Vec::new();
+        while at < png.len() {
+            let len = u32::from_be_bytes([png[at], png[at + 1], png[at + 2], png[at + 3]]) as usize;
+            let chunk = &png[at + 4..at + 8 + len];
+            let crc = &png[at + 8 + len..at + 12 + len];
+            assert_eq!(crc, &crc32(chunk).to_be_bytes());
+            if &chunk[..4] == b"IDAT" {
+                zlib.extend_from_slice(&chunk[4..]);
+            }
+            at += 12 + len;
+        }
+        let mut rows = Vec::new();
+        let mut at = 2;
+        loop {
+            let last = zlib[at] & 1 != 0;
+            let len = u16::from_le_bytes([zlib[at + 1], zlib[at + 2]]) as usize;
+            rows.extend_from_slice(&zlib[at + 5..at + 5 + len]);
+            at += 5 + len;
+            if last {
+                break;
+            }
+        }
+        assert_eq!(&zlib[at..], &adler32(&rows).to_be_bytes());
+        rows.chunks_exact(1 + SCREEN_WIDTH / 8)
+            .flat_map(|row| row[1..].chunks_exact(2))
+            .map(|bits| (!u16::from_be_bytes([bits[0], bits[1]])).reverse_bits() as i16 as i32)
+            .collect()
+    }
+
+    #[test]
+    fn test_png() {
+        assert_eq!(crc32(b"IEND"), 0xae426082);
+        let screen = screen_with(&[(0, 1), (33, -1), (SCREEN_WORDS - 1, 0x4000)]);
+        let png = screen_to_png(&screen);
+        assert_eq!(png_to_screen(&png), screen);
+        // the rows end before the adler32, the IDAT crc and the IEND chunk
+        let first_row = png.len() - 4 - 4 - 12 - 16640;
+        // the top left pixel is black, the ones next to it white
+        assert_eq!(png[first_row], 0);
+        assert_eq!(png[first_row + 1], 0b0111_1111);
+    }
+
+    #[test]
+    fn test_record_frames() {
+        let program = VMProgram::new(&vec![(
+            "Sys.vm",
+            "
+            function Sys.init 0
+                push constant 16384
+                pop pointer 1
+                label LOOP
+                push that 0
+                push constant 1
+                add
+                pop that 0
+                goto LOOP
+            return
+            ",
+        )])
+        .unwrap();
+        let mut vm = VMEmulator::new(program);
+        vm.init().unwrap();
+        let mut frames = FrameWriter::new();
+        record_frames(&mut vm, 1050, 100, &mut frames).unwrap();
+
+        let bytes = frames.into_bytes();
+        let mut reader = FrameReader::new(&bytes).unwrap();
+        let mut steps = Vec::new();
+        while let Some(step) = reader.next_frame().unwrap() {
+            steps.push(step);
+        }
+        assert_eq!(steps.len(), 11);
+        assert_eq!(steps.last(), Some(&1050));
+        assert_eq!(reader.screen()[0] as i32, vm.screen()[0]);
+        assert!(reader.screen()[0] > 0);
+    }
+
+    #[test]
+    fn test_record_frames_until_return() {
+        let program = || {
+            VMProgram::new(&vec![(
+                "Sys.vm",
+                "
+                function Sys.init 0
+                    push constant 16384
+                    pop pointer 1
+                    push constant 5
+                    pop that 0
+                    push constant 0
+                return
+                ",
+            )])
+            .unwrap()
+        };
+        let mut vm = VMEmulator::new(program());
+        vm.init().unwrap();
+        let mut total = 1;
+        while vm.step_threaded().unwrap().is_none() {
+            total += 1;
+        }
+
+        // the program returns on a frame boundary, which still gets its frame
+        let mut vm = VMEmulator::new(program());
+        vm.init().unwrap();
+        let mut frames = FrameWriter::new();
+        record_frames(&mut vm, 100, total, &mut frames).unwrap();
+        let bytes = frames.into_bytes();
+        let mut reader = FrameReader::new(&bytes).unwrap();
+        assert_eq!(reader.next_frame(), Ok(Some(total as u64)));
+        assert_eq!(reader.screen()[0], 5);
+        assert_eq!(reader.next_frame(), Ok(None));
+
+        let mut vm = VMEmulator::new(program());
+        vm.init().unwrap();
+        assert!(record_frames(&mut vm, 100, 0, &mut FrameWriter::new()).is_err());
+    }
+}
@@ -1,8 +1,13 @@
-use super::vmparser::{parse_lines, Token};
+use super::vmlinker::DeadFunctions;
+use super::vmparser::{parse_lines, StreamedTokens, Token};
+use super::vmsymbols::{FunctionTable, Interner, Symbol};
 use std::cmp;
 use std::collections::HashMap;
 use std::fmt;
 
+/// Statics of all files share RAM 16..255, up to where the stack starts.
+pub const MAX_STATICS: usize = 240;
+
 #[derive(PartialEq, Copy, Clone, Debug)]
 pub enum Segment {
     Constant,
@@ -28,6 +33,18 @@ pub struct InCodeFuncRef {
 }
 
 impl InCodeFuncRef {
+    pub fn new(file_index: usize, function_index: usize) -> InCodeFuncRef {
+        InCodeFuncRef {
+            file_index,
+            function_index,
+        }
+    }
+    pub fn file_index(&self) -> usize {
+        self.file_index
+    }
+    pub fn function_index(&self) -> usize {
+        self.function_index
+    }
     pub fn to_function_ref(self) -> FunctionRef {
         FunctionRef::InCode(self)
     }
@@ -41,10 +58,7 @@ pub enum FunctionRef {
 
 impl FunctionRef {
     pub fn new(file_index: usize, function_index: usize) -> FunctionRef {
-        FunctionRef::InCode(InCodeFuncRef {
-            file_index,
-            function_index,
-        })
+        FunctionRef::InCode(InCodeFuncRef::new(file_index, function_index))
     }
 }
 
@@ -80,6 +94,8 @@ pub enum Command {
     Call(FunctionRef, u16),
 
     // optimized commands
+    /// A call immediately followed by a return, which reuses the caller's frame.
+    TailCall(FunctionRef, u16),
     CopySeg {
         from_segment: Segment,
         from_index: u16,
@@ -114,7 +130,7 @@ impl Command {
                 )
             }
             Command::Return => "return".to_string(),
-            Command::Call(func_ref, num_args) => {
+            Command::Call(func_ref, num_args) | Command::TailCall(func_ref, num_args) => {
                 format!(
                     "call {} {}",
                     program
@@ -139,12 +155,31 @@ impl Command {
     }
 }
 
+/// A range of commands in a function that was produced by inlining a call to
+/// another function. Used to attribute steps back to the logical callee.
+#[derive(PartialEq, Copy, Clone, Debug)]
+pub struct InlinedCall {
+    pub start: usize,
+    pub end: usize,
+    pub function: FunctionRef,
+}
+
 #[derive(Debug, Clone)]
 pub struct VMFunction {
     pub id: FunctionRef,
     pub name: String,
     pub num_locals: usize,
     pub commands: Vec<Command>,
+    pub inlined: Vec<InlinedCall>,
+}
+
+impl VMFunction {
+    /// Returns the inlined call that the command at `index` belongs to, if any.
+    pub fn get_inlined_call(&self, index: usize) -> Option<&InlinedCall> {
+        self.inlined
+            .iter()
+            .find(|call| call.start <= index && index < call.end)
+    }
 }
 
 #[derive(Debug, Clone)]
@@ -155,12 +190,11 @@ pub struct VMFile {
     pub static_offset: usize,
 }
 
-type FunctionTable = bimap::BiMap<String, FunctionRef>;
-type LabelTable = HashMap<String, usize>;
+type LabelTable = HashMap<Symbol, usize>;
 
-#[derive(PartialEq, Clone, Debug)]
-enum OptimizedToken {
-    Base(Token),
+#[derive(PartialEq, Copy, Clone, Debug)]
+enum OptimizedToken<'a> {
+    Base(Token<'a>),
     CopySeg {
         from_segment: Segment,
         from_index: u16,
@@ -169,26 +203,26 @@ enum OptimizedToken {
     },
 }
 
-struct TokenizedFunction {
-    name: String,
-    commands: Vec<Token>,
+struct TokenizedFunction<'a> {
+    name: &'a str,
+    commands: &'a [Token<'a>],
 }
-impl TokenizedFunction {
-    fn from_tokens(tokens: &[Token]) -> Result<TokenizedFunction, String> {
+impl<'a> TokenizedFunction<'a> {
+    fn from_tokens(tokens: &'a [Token<'a>]) -> Result<TokenizedFunction<'a>, String> {
         let first_token = &tokens
             .get(0)
             .ok_or_else(|| "Failed creating tokenized functions. No tokens provided.")?;
         if let Token::Function(func_name, _) = first_token {
             Ok(TokenizedFunction {
-                name: func_name.clone(),
-                commands: tokens.to_vec(),
+                name: func_name,
+                commands: tokens,
             })
         } else {
             Err(format!("Failed creating tokenized function. Tokens don't start with a function declaration. Found {:?} instead.", first_token))
         }
     }
-    fn get_optimized_tokens(&self) -> Vec<OptimizedToken> {
-        let mut optimized: Vec<OptimizedToken> = Vec::new();
+    fn get_optimized_tokens(&self) -> Vec<OptimizedToken<'a>> {
+        let mut optimized: Vec<OptimizedToken> = Vec::with_capacity(self.commands.len());
         let mut i = 0;
         while i < self.commands.len() {
             if i + 1 < self.commands.len() {
@@ -205,29 +239,32 @@ impl TokenizedFunction {
                         i += 2;
                     }
                     _ => {
-                        optimized.push(OptimizedToken::Base(a.clone()));
+                        optimized.push(OptimizedToken::Base(*a));
                         i += 1;
                     }
                 }
             } else {
-                optimized.push(OptimizedToken::Base(self.commands[i].clone()));
+                optimized.push(OptimizedToken::Base(self.commands[i]));
                 i += 1;
             }
         }
         return optimized;
     }
 }
-struct TokenizedFunctionOptimized {
-    name: String,
+struct TokenizedFunctionOptimized<'a> {
+    name: &'a str,
     label_table: LabelTable,
-    commands: Vec<OptimizedToken>,
+    commands: Vec<OptimizedToken<'a>>,
 }
 
-impl TokenizedFunctionOptimized {
-    fn from(tokenized_func: TokenizedFunction) -> Result<TokenizedFunctionOptimized, String> {
+impl<'a> TokenizedFunctionOptimized<'a> {
+    fn from(
+        tokenized_func: TokenizedFunction<'a>,
+        symbols: &mut Interner,
+    ) -> Result<TokenizedFunctionOptimized<'a>, String> {
         let optimized = tokenized_func.get_optimized_tokens();
         let (label_table, command_tokens) =
-            TokenizedFunctionOptimized::build_label_table(&optimized).map_err(|e| {
+            TokenizedFunctionOptimized::build_label_table(optimized, symbols).map_err(|e| {
                 format!(
                     "failed building label table for {}: {}",
                     tokenized_func.name, e
@@ -240,42 +277,48 @@ impl TokenizedFunctionOptimized {
         })
     }
 
-    fn from_tokens(tokens: &[Token]) -> Result<TokenizedFunctionOptimized, String> {
+    fn from_tokens(
+        tokens: &'a [Token<'a>],
+        symbols: &mut Interner,
+    ) -> Result<TokenizedFunctionOptimized<'a>, String> {
         let tokenized_func = TokenizedFunction::from_tokens(tokens)?;
-        Self::from(tokenized_func)
+        Self::from(tokenized_func, symbols)
     }
 
+    /// Removes the labels from a function's tokens, recording the index of
+    /// the command each one points at.
     fn build_label_table(
-        func_tokens: &[OptimizedToken],
-    ) -> Result<(LabelTable, Vec<OptimizedToken>), String> {
+        mut func_tokens: Vec<OptimizedToken<'a>>,
+        symbols: &mut Interner,
+    ) -> Result<(LabelTable, Vec<OptimizedToken<'a>>), String> {
         let mut label_table: LabelTable = HashMap::new();
         let mut command_index = 0;
-        let mut command_tokens: Vec<OptimizedToken> = Vec::new();
-        for token in func_tokens.iter() {
+        for i in 0..func_tokens.len() {
+            let token = func_tokens[i];
             if let OptimizedToken::Base(Token::Label(label)) = token {
-                match label_table.get(label) {
-                    Some(_) => return Err(format!("label {:?} declared twice", label)),
-                    None => {
-                        println!("Inserting label {}", label);
-                        label_table.insert(label.to_string(), command_index);
-                    }
+                if label_table
+                    .insert(symbols.intern(label), command_index)
+                    .is_some()
+                {
+                    return Err(format!("label {:?} declared twice", label));
                 }
             } else {
-                command_tokens.push(token.clone());
+                func_tokens[command_index] = token;
                 command_index += 1;
             }
         }
-        return Ok((label_table, command_tokens));
+        func_tokens.truncate(command_index);
+        return Ok((label_table, func_tokens));
     }
 }
 
-struct TokenizedFile {
-    name: String,
-    functions: Vec<TokenizedFunction>,
+struct TokenizedFile<'a> {
+    name: &'a str,
+    functions: Vec<TokenizedFunction<'a>>,
 }
 
-impl TokenizedFile {
-    fn from_tokens(name: &str, tokens: &[Token]) -> Result<TokenizedFile, String> {
+impl<'a> TokenizedFile<'a> {
+    fn from_tokens(name: &'a str, tokens: &'a [Token<'a>]) -> Result<TokenizedFile<'a>, String> {
         let iter = GroupByBound::new(tokens, |token| match token {
             Token::Function(_, _) => true,
             _ => false,
@@ -285,42 +328,111 @@ impl TokenizedFile {
             .collect::<Result<Vec<_>, String>>()
             .map_err(|e| format!("Failed tokenizing file: {}", e))?;
         return Ok(TokenizedFile {
-            name: name.to_string(),
+            name,
             functions: funcs,
         });
     }
 }
 
-struct TokenizedProgram {
-    files: Vec<TokenizedFile>,
-}
+/// Maps `f` over `items`, spreading the items across threads on native
+/// builds. Threads take the next unprocessed item as they finish, so one large
+/// file doesn't hold up the rest. Results are returned in the order of
+/// `items`, so anything built from them afterwards is deterministic.
+fn map_in_parallel<'a, T, R, F>(items: &'a [T], f: F) -> Vec<R>
+where
+    T: Sync,
+    R: Send,
+    F: Fn(&'a T) -> R + Sync,
+{
+    #[cfg(not(target_arch = "wasm32"))]
+    {
+        use std::sync::atomic::{AtomicUsize, Ordering};
+        use std::thread;
 
-impl TokenizedProgram {
-    fn from_files(files: &[(&str, &str)]) -> Result<TokenizedProgram, String> {
-        let tokenized_files = files
-            .iter()
-            .map(|(filename, content)| {
-                parse_lines(content)
-                    .map(|tokens| (filename, tokens))
-                    .map_err(|e| {
-                        format!(
-                            "Failed tokenizing program: Couldn't parse {}: {}",
-                            filename, e
-                        )
+        let num_threads = thread::available_parallelism()
+            .map_or(1, |n| n.get())
+            .min(items.len());
+        if num_threads > 1 {
+            let next = AtomicUsize::new(0);
+            let mut results: Vec<Option<R>> = (0..items.len()).map(|_| None).collect();
+            thread::scope(|scope| {
+                let workers: Vec<_> = (0..num_threads)
+                    .map(|_| {
+                        scope.spawn(|| {
+                            let mut done = Vec::new();
+                            loop {
+                                let i = next.fetch_add(1, Ordering::Relaxed);
+                                match items.get(i) {
+                                    Some(item) => done.push((i, f(item))),
+                                    None => return done,
+                                }
+                            }
+                        })
                     })
-            })
-            .map(|result| {
-                let (filename, file_tokens) = result?;
-                if file_tokens.len() == 0 {
-                    Err(format!(
-                        "Failed tokenizing program: File {} has no vm commands",
-                        filename
-                    ))
-                } else {
-                    TokenizedFile::from_tokens(*filename, &file_tokens)
+                    .collect();
+                for worker in workers {
+                    let done = worker
+                        .join()
+                        .unwrap_or_else(|e| std::panic::resume_unwind(e));
+                    for (i, result) in done {
+                        results[i] = Some(result);
+                    }
                 }
-            })
-            .collect::<Result<Vec<TokenizedFile>, String>>()?;
+            });
+            return results.into_iter().map(Option::unwrap).collect();
+        }
+    }
+    items.iter().map(f).collect()
+}
+
+/// The tokens of each file of a program, which the tokenized program borrows.
+type ParsedFiles<'a> = Vec<(&'a str, Vec<Token<'a>>)>;
+
+fn check_not_empty<'a>(
+    filename: &'a str,
+    tokens: Vec<Token<'a>>,
+) -> Result<(&'a str, Vec<Token<'a>>), String> {
+    if tokens.len() == 0 {
+        return Err(format!(
+            "Failed tokenizing program: File {} has no vm commands",
+            filename
+        ));
+    }
+    Ok((filename, tokens))
+}
+
+struct TokenizedProgram<'a> {
+    files: Vec<TokenizedFile<'a>>,
+}
+
+impl<'a> TokenizedProgram<'a> {
+    fn parse_files(files: &[(&'a str, &'a str)]) -> Result<ParsedFiles<'a>, String> {
+        map_in_parallel(files, |(filename, content)| {
+            let tokens = parse_lines(content).map_err(|e| {
+                format!(
+                    "Failed tokenizing program: Couldn't parse {}: {}",
+                    filename, e
+                )
+            })?;
+            check_not_empty(filename, tokens)
+        })
+        .into_iter()
+        .collect()
+    }
+
+    fn from_streams(files: &'a [(String, StreamedTokens)]) -> Result<ParsedFiles<'a>, String> {
+        files
+            .iter()
+            .map(|(filename, tokens)| check_not_empty(filename, tokens.tokens()))
+            .collect()
+    }
+
+    fn from_files(parsed_files: &'a ParsedFiles<'a>) -> Result<TokenizedProgram<'a>, String> {
+        let tokenized_files = map_in_parallel(parsed_files, |(filename, file_tokens)| {
+            TokenizedFile::from_tokens(filename, file_tokens)
+        })
+        .into_iter()
+        .collect::<Result<Vec<TokenizedFile>, String>>()?;
         Ok(TokenizedProgram {
             files: tokenized_files,
         })
@@ -332,17 +444,17 @@ pub struct VMProgram {
     pub files: Vec<VMFile>,
     pub function_table: FunctionTable,
     pub warnings: Vec<Box<str>>,
+    /// Functions the linker removed because nothing calls them.
+    pub dead_functions: DeadFunctions,
 }
 
 impl VMProgram {
     pub fn get_function_name(&self, func_ref: &FunctionRef) -> Option<&str> {
-        self.function_table.get_by_right(func_ref).map(|s| &s[..])
+        self.function_table.get_name(func_ref)
     }
     pub fn get_function_ref(&self, name: &str) -> Option<InCodeFuncRef> {
-        if let Some(FunctionRef::InCode(in_code_ref)) =
-            self.function_table.get_by_left(&name.to_string())
-        {
-            Some(*in_code_ref)
+        if let Some(FunctionRef::InCode(in_code_ref)) = self.function_table.get(name) {
+            Some(in_code_ref)
         } else {
             None
         }
@@ -363,8 +475,9 @@ impl VMProgram {
     pub fn empty() -> VMProgram {
         VMProgram {
             files: Vec::new(),
-            function_table: bimap::BiMap::new(),
+            function_table: FunctionTable::new(),
             warnings: Vec::new(),
+            dead_functions: DeadFunctions::default(),
         }
     }
 
@@ -375,22 +488,46 @@ impl VMProgram {
         files: &Vec<(&str, &str)>,
         internal_funcs: Option<HashMap<&'static str, FunctionRef>>,
     ) -> Result<VMProgram, String> {
-        let tokenized_program = TokenizedProgram::from_files(files)
+        let parsed_files = TokenizedProgram::parse_files(files)
             .map_err(|e| format!("Failed to create VMProgram: {}", e))?;
+        VMProgram::from_parsed_files(&parsed_files, internal_funcs)
+    }
 
-        let mut function_table: FunctionTable = bimap::BiMap::new();
+    /// Builds a program from files that were tokenized ahead of time with a
+    /// `TokenStream`, given as (filename, tokens) pairs.
+    pub fn from_streams(
+        files: &[(String, StreamedTokens)],
+        internal_funcs: Option<HashMap<&'static str, FunctionRef>>,
+    ) -> Result<VMProgram, String> {
+        let parsed_files = TokenizedProgram::from_streams(files)
+            .map_err(|e| format!("Failed to create VMProgram: {}", e))?;
+        VMProgram::from_parsed_files(&parsed_files, internal_funcs)
+    }
+
+    fn from_parsed_files(
+        parsed_files: &ParsedFiles,
+        internal_funcs: Option<HashMap<&'static str, FunctionRef>>,
+    ) -> Result<VMProgram, String> {
+        let tokenized_program = TokenizedProgram::from_files(&parsed_files)
+            .map_err(|e| format!("Failed to create VMProgram: {}", e))?;
+
+        let mut function_table = FunctionTable::new();
         // let mut tokenized_files: Vec<TokenizedFile> = Vec::new();
         let mut warnings: Vec<Box<str>> = Vec::new();
         // tokenize files and build function table
         if let Some(internal_funcs) = internal_funcs {
-            for (func_name, internal_func_ref) in internal_funcs.iter() {
-                function_table.insert(func_name.to_string(), *internal_func_ref);
+            // sorted, so that linking the same files always interns the names
+            // in the same order and serializes to the same bytes
+            let mut internal_funcs: Vec<_> = internal_funcs.into_iter().collect();
+            internal_funcs.sort_by_key(|(func_name, _)| *func_name);
+            for (func_name, internal_func_ref) in internal_funcs {
+                function_table.insert(func_name, internal_func_ref);
             }
         }
 
         for (file_index, tokenized_file) in tokenized_program.files.iter().enumerate() {
             for (function_index, tokenized_func) in tokenized_file.functions.iter().enumerate() {
-                match function_table.get_by_left(&tokenized_func.name) {
+                match function_table.get(tokenized_func.name) {
                     Some(FunctionRef::InCode { .. }) => {
                         return Err(format!("function {:?} declared twice", tokenized_func.name));
                     }
@@ -399,7 +536,7 @@ impl VMProgram {
                     }
                     None => {
                         function_table.insert(
-                            tokenized_func.name.clone(),
+                            tokenized_func.name,
                             FunctionRef::new(file_index, function_index),
                         );
                     }
@@ -412,30 +549,28 @@ impl VMProgram {
         let mut static_offset = 0_usize;
         for tokenized_file in tokenized_program.files.into_iter() {
             let mut vmfile = VMFile {
-                name: tokenized_file.name.clone(),
+                name: tokenized_file.name.to_string(),
                 functions: Vec::new(),
                 num_statics: 0,
                 static_offset,
             };
-            for tokenized_func in tokenized_file
-                .functions
-                .into_iter()
-                .map(TokenizedFunctionOptimized::from)
-            {
-                let tokenized_func = tokenized_func?;
+            for tokenized_func in tokenized_file.functions.into_iter() {
+                let tokenized_func =
+                    TokenizedFunctionOptimized::from(tokenized_func, &mut function_table.symbols)?;
                 let label_table = &tokenized_func.label_table;
                 let mut tokens = tokenized_func.commands.iter();
                 if let OptimizedToken::Base(Token::Function(func_name, num_locals)) =
                     tokens.next().unwrap()
                 {
-                    let function_ref = *function_table
-                        .get_by_left(&func_name.to_string())
+                    let function_ref = function_table
+                        .get(func_name)
                         .expect("Expected to find function name in function table");
                     let mut vmfunc = VMFunction {
                         id: function_ref,
                         name: func_name.to_string(),
                         num_locals: *num_locals as usize,
                         commands: vec![Command::Function(function_ref, *num_locals)],
+                        inlined: Vec::new(),
                     };
 
                     for token in tokens {
@@ -446,6 +581,8 @@ impl VMProgram {
                                 to_segment,
                                 to_index,
                             } => {
+                                check_segment_index(*from_segment, *from_index, *num_locals)?;
+                                check_segment_index(*to_segment, *to_index, *num_locals)?;
                                 if *from_segment == Segment::Static {
                                     vmfile.num_statics =
                                         cmp::max(vmfile.num_statics, (from_index + 1).into());
@@ -479,10 +616,7 @@ impl VMProgram {
                                 // function commands
                                 Token::Function(_, _) => panic!("Didn't expect Token::Function"),
                                 Token::Call(func_to_call, num_args) => {
-                                    match function_table
-                                        .get_by_left(&func_to_call.to_string())
-                                        .copied()
-                                    {
+                                    match function_table.get(func_to_call) {
                                         Some(func_ref) => Command::Call(func_ref, *num_args),
                                         None => {
                                             warnings.push(
@@ -501,21 +635,17 @@ impl VMProgram {
                                 // goto commands
                                 Token::Label(_) => panic!("Didn't expect Token::Label"),
                                 Token::If(label) => {
-                                    let index = label_table
-                                        .get(label)
-                                        .ok_or(format!("label {:?} does not exist", label))?;
-                                    Command::If(*index)
-                                }
-                                Token::Goto(label) => {
-                                    let index = label_table
-                                        .get(label)
-                                        .ok_or(format!("label {:?} does not exist", label))?;
-                                    Command::Goto(*index)
+                                    Command::If(resolve_label(label_table, &function_table, label)?)
                                 }
+                                Token::Goto(label) => Command::Goto(resolve_label(
+                                    label_table,
+                                    &function_table,
+                                    label,
+                                )?),
 
                                 // stack commands
-                                // TODO: verify indexes for segments
                                 Token::Push(segment, index) => {
+                                    check_segment_index(*segment, *index, *num_locals)?;
                                     if *segment == Segment::Static {
                                         vmfile.num_statics =
                                             cmp::max(vmfile.num_statics, (index + 1).into());
@@ -523,6 +653,7 @@ impl VMProgram {
                                     Command::Push(*segment, *index)
                                 }
                                 Token::Pop(segment, index) => {
+                                    check_segment_index(*segment, *index, *num_locals)?;
                                     if *segment == Segment::Static {
                                         vmfile.num_statics =
                                             cmp::max(vmfile.num_statics, (index + 1).into());
@@ -539,16 +670,123 @@ impl VMProgram {
                 }
             }
             static_offset += vmfile.num_statics;
+            if static_offset > MAX_STATICS {
+                return Err(format!(
+                    "the program needs {} statics by {}, but only {} fit before the stack",
+                    static_offset, vmfile.name, MAX_STATICS
+                ));
+            }
             files.push(vmfile);
         }
+        check_argument_counts(&files, &function_table)?;
         return Ok(VMProgram {
             files,
             function_table,
             warnings,
+            dead_functions: DeadFunctions::default(),
         });
     }
 }
 
+fn resolve_label(
+    label_table: &LabelTable,
+    function_table: &FunctionTable,
+    label: &str,
+) -> Result<usize, String> {
+    function_table
+        .symbols
+        .get(label)
+        .and_then(|symbol| label_table.get(&symbol))
+        .copied()
+        .ok_or_else(|| format!("label {:?} does not exist", label))
+}
+
+/// Checks that a constant segment index is within the bounds of its segment,
+/// so that the emulator doesn't need to check it when the command runs.
+/// Static segments grow to fit whatever indexes are used, and `this`/`that`
+/// can point anywhere in memory, so only the fixed size segments are checked.
+pub fn check_segment_index(segment: Segment, index: u16, num_locals: u16) -> Result<(), String> {
+    let size = match segment {
+        Segment::Temp => 8,
+        Segment::Pointer => 2,
+        Segment::Local => num_locals,
+        _ => return Ok(()),
+    };
+    if index >= size {
+        return Err(format!(
+            "{:?} index {} is out of bounds, the segment only has {} entries",
+            segment, index, size
+        ));
+    }
+    Ok(())
+}
+
+/// Rejects calls that pass fewer arguments than the function reads. Argument
+/// reads aren't bounds checked when the threaded code runs, so the callee
+/// would read the caller's saved frame instead of failing.
+fn check_argument_counts(
+    files: &Vec<VMFile>,
+    function_table: &FunctionTable,
+) -> Result<(), String> {
+    let num_args_used = |function: &VMFunction| -> u16 {
+        let mut used = 0;
+        for command in function.commands.iter() {
+            let indexes = match *command {
+                Command::Push(Segment::Argument, index)
+                | Command::Pop(Segment::Argument, index) => [Some(index), None],
+                Command::CopySeg {
+                    from_segment,
+                    from_index,
+                    to_segment,
+                    to_index,
+                } => [
+                    Some(from_index).filter(|_| from_segment == Segment::Argument),
+                    Some(to_index).filter(|_| to_segment == Segment::Argument),
+                ],
+                _ => [None, None],
+            };
+            for index in indexes.iter().flatten() {
+                used = cmp::max(used, index + 1);
+            }
+        }
+        used
+    };
+    let args_used: Vec<Vec<u16>> = files
+        .iter()
+        .map(|file| file.functions.iter().map(num_args_used).collect())
+        .collect();
+    // the emulator starts Sys.init without any arguments
+    if let Some(FunctionRef::InCode(init)) = function_table.get("Sys.init") {
+        let used = args_used[init.file_index][init.function_index];
+        if used > 0 {
+            return Err(format!("Sys.init takes no arguments but it reads {}", used));
+        }
+    }
+    for file in files.iter() {
+        for function in file.functions.iter() {
+            for command in function.commands.iter() {
+                if let Command::Call(FunctionRef::InCode(callee), num_args) = command {
+                    let used = args_used
+                        .get(callee.file_index)
+                        .and_then(|file| file.get(callee.function_index));
+                    if let Some(used) = used.filter(|used| *num_args < **used) {
+                        return Err(format!(
+                            "{} calls {} with {} arguments but it reads {}",
+                            function.name,
+                            function_table
+                                .get_name(&FunctionRef::InCode(*callee))
+                                .map_or("an unknown function", |name| &name[..]),
+                            num_args,
+                            used
+                        ));
+                    }
+                }
+            }
+        }
+    }
+    Ok(())
+}
+
 struct GroupByBound<'a, T, P>
 where
     P: Fn(&T) -> bool,
@@ -562,7 +800,7 @@ impl<'a, T, P> GroupByBound<'a, T, P>
 where
     P: Fn(&T) -> bool,
 {
-    fn new(data: &'a [T], pred: P) -> GroupByBound<T, P> {
+    fn new(data: &'a [T], pred: P) -> GroupByBound<'a, T, P> {
         GroupByBound { data, pred, i: 0 }
     }
 }
@@ -674,6 +912,92 @@ mod tests {
         );
     }
 
+    #[test]
+    fn test_map_in_parallel() {
+        let items: Vec<usize> = (0..100).collect();
+        assert_eq!(
+            map_in_parallel(&items, |i| i * 2),
+            (0..100).map(|i| i * 2).collect::<Vec<_>>()
+        );
+        assert_eq!(map_in_parallel(&items[..0], |i| *i), vec![]);
+    }
+
+    #[test]
+    fn test_load_many_files() {
+        let sources: Vec<(String, String)> = (0..20)
+            .map(|i| {
+                (
+                    format!("File{}.vm", i),
+                    format!("function File{}.get 0\npush static {}\nreturn\n", i, i % 3),
+                )
+            })
+            .collect();
+        let files: Vec<(&str, &str)> = sources.iter().map(|(a, b)| (&a[..], &b[..])).collect();
+        let program = VMProgram::new(&files).unwrap();
+        let mut static_offset = 0;
+        for (i, file) in program.files.iter().enumerate() {
+            assert_eq!(file.name, format!("File{}.vm", i));
+            assert_eq!(file.static_offset, static_offset);
+            static_offset += i % 3 + 1;
+            assert_eq!(
+                program.function_table.get(&format!("File{}.get", i)),
+                Some(FunctionRef::new(i, 0))
+            );
+        }
+    }
+
+    #[test]
+    fn test_segment_index_validation() {
+        let load = |body: &str| {
+            VMProgram::new(&vec![(
+                "Sys.vm",
+                &format!("function Sys.init 2\n{}\nreturn", body)[..],
+            )])
+            .err()
+            .unwrap_or_default()
+        };
+        assert_eq!(load("push local 1"), "");
+        assert_eq!(load("push temp 7\npop pointer 1"), "");
+        assert!(load("push local 2").contains("Local index 2"));
+        assert!(load("pop temp 8").contains("Temp index 8"));
+        assert!(load("push pointer 2").contains("Pointer index 2"));
+        assert!(load("push constant 1\npop local 5").contains("Local index 5"));
+        assert_eq!(load("push static 239"), "");
+        assert!(load("push static 240").contains("241 statics"));
+
+        // the limit is on the statics of all files together
+        let file = |name: &str| {
+            (
+                name.to_string(),
+                format!("function {}.f 0\npush static 119\nreturn", name),
+            )
+        };
+        let files = vec![file("Sys"), file("A"), file("B")];
+        let err = VMProgram::new(&files.iter().map(|(a, b)| (&a[..], &b[..])).collect())
+            .err()
+            .unwrap_or_default();
+        assert!(err.contains("360 statics"), "unexpected error: {}", err);
+
+        let program = VMProgram::new(&vec![(
+            "Sys.vm",
+            "
+            function Sys.init 0
+                push constant 1
+                call Sys.add 1
+            return
+
+            function Sys.add 0
+                push argument 0
+                push argument 1
+                add
+            return",
+        )]);
+        assert_eq!(
+            program.err(),
+            Some("Sys.init calls Sys.add with 1 arguments but it reads 2".to_string())
+        );
+    }
+
     #[test]
     fn test_vmprogram_new() {
         let program = VMProgram::new(&vec![(
@@ -710,12 +1034,12 @@ mod tests {
         assert_eq!(program.files.len(), 1);
         assert_eq!(program.files[0].functions.len(), 2);
         assert_eq!(
-            program.function_table.get_by_left("Sys.init").unwrap(),
-            &FunctionRef::new(0, 0)
+            program.function_table.get("Sys.init").unwrap(),
+            FunctionRef::new(0, 0)
         );
         assert_eq!(
-            program.function_table.get_by_left("Sys.incr").unwrap(),
-            &FunctionRef::new(0, 1)
+            program.function_table.get("Sys.incr").unwrap(),
+            FunctionRef::new(0, 1)
         );
         assert_eq!(
             program.files[0].functions[0].commands[0],
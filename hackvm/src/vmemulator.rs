@@ -1,8 +1,18 @@
 use super::vmcommand::{Command, FunctionRef, InCodeFuncRef, Operation, Segment, VMProgram};
+use super::vmlinker::logical_function;
+use super::vmprofile::{FunctionProfile, Profile};
+use super::vmscreen::{ScreenChanges, SCREEN_START, SCREEN_WORDS};
+use super::vmthreaded::{Instruction, LinkedProgram, Opcode, ThreadedCode, NUM_OPCODES};
+use super::vmthreaded::{ARG, LCL, SP, THAT, THIS};
 use std::collections::HashMap;
 use std::convert::TryInto;
+use std::sync::Arc;
 
 const RAM_SIZE: usize = 16384 + 8192 + 1;
+// addresses are 15 bits wide, see VMEmulator::load
+const RAM_MASK: usize = 0x7fff;
+// the stack may grow up to the screen, past which pushes would draw on it
+const STACK_END: usize = SCREEN_START;
 
 #[derive(Debug)]
 struct VMStackFrame {
@@ -11,16 +21,26 @@ struct VMStackFrame {
     function: InCodeFuncRef,
     index: usize,
     num_args: usize,
+    // where the function starts in the threaded code
+    code_start: usize,
+    // whether the function's stack depths were verified
+    verified: bool,
+    // the most words the function has on its stack, if verified
+    max_stack_depth: usize,
 }
 
 impl VMStackFrame {
-    fn new(function: InCodeFuncRef, num_args: usize) -> VMStackFrame {
+    fn new(function: InCodeFuncRef, num_args: usize, code: &ThreadedCode) -> VMStackFrame {
+        let threaded = code.function(&function);
         VMStackFrame {
             local_segment: Vec::new(),
             stack_size: 0,
             function,
             index: 0,
             num_args,
+            code_start: threaded.map_or(usize::MAX, |f| f.start),
+            verified: threaded.map_or(false, |f| f.verified),
+            max_stack_depth: threaded.map_or(0, |f| f.max_stack_depth),
         }
     }
 }
@@ -28,6 +48,8 @@ impl VMStackFrame {
 struct VMProfileFuncStats {
     num_calls: u64,
     num_steps: u64,
+    // steps running the function's own code, including code inlined into it
+    num_code_steps: u64,
 }
 
 struct VMProfiler {
@@ -46,6 +68,7 @@ impl VMProfiler {
             Some(stats) => {
                 stats.num_calls += func_stats.num_calls;
                 stats.num_steps += func_stats.num_steps;
+                stats.num_code_steps += func_stats.num_code_steps;
             }
             None => {
                 self.function_stats.insert(func_ref, func_stats);
@@ -59,6 +82,18 @@ impl VMProfiler {
             VMProfileFuncStats {
                 num_calls: 0,
                 num_steps: 1,
+                num_code_steps: 0,
+            },
+        );
+    }
+
+    pub fn count_code_step(&mut self, func_ref: FunctionRef) {
+        self.add_function_stats(
+            func_ref,
+            VMProfileFuncStats {
+                num_calls: 0,
+                num_steps: 0,
+                num_code_steps: 1,
             },
         );
     }
@@ -69,6 +104,7 @@ impl VMProfiler {
             VMProfileFuncStats {
                 num_calls: 1,
                 num_steps: 0,
+                num_code_steps: 0,
             },
         );
     }
@@ -111,38 +147,356 @@ const INTERNALS: [InternalFunction; 2] = [
     },
 ];
 
+type StepResult = Result<Option<i32>, String>;
+
+/// Executes one pre-decoded instruction of the threaded code.
+struct OpcodeHandler {
+    opcode: Opcode,
+    func: fn(&mut VMEmulator, Instruction) -> StepResult,
+}
+
+/// Builds the table of handlers for the threaded code, indexed by opcode.
+///
+/// Unchecked handlers run functions whose stack depths were verified when the
+/// code was decoded, so they skip the function and global stack bounds checks
+/// and don't keep track of the frame's stack size. Before handing off to code
+/// that relies on it they set the stack size from the verified depth instead.
+const fn handler_table<const CHECKED: bool>() -> [OpcodeHandler; NUM_OPCODES] {
+    [
+        OpcodeHandler {
+            opcode: Opcode::PushConstant,
+            func: |vm, instruction| vm.op_push::<CHECKED>(instruction.a as i32),
+        },
+        OpcodeHandler {
+            opcode: Opcode::PushLocal,
+            func: VMEmulator::op_push_segment::<LCL, CHECKED>,
+        },
+        OpcodeHandler {
+            opcode: Opcode::PushArgument,
+            func: VMEmulator::op_push_segment::<ARG, CHECKED>,
+        },
+        OpcodeHandler {
+            opcode: Opcode::PushThis,
+            func: VMEmulator::op_push_segment::<THIS, CHECKED>,
+        },
+        OpcodeHandler {
+            opcode: Opcode::PushThat,
+            func: VMEmulator::op_push_segment::<THAT, CHECKED>,
+        },
+        OpcodeHandler {
+            opcode: Opcode::PushStatic,
+            func: |vm, instruction| vm.op_push::<CHECKED>(vm.load(instruction.a as usize)),
+        },
+        OpcodeHandler {
+            opcode: Opcode::PushTemp,
+            func: |vm, instruction| vm.op_push::<CHECKED>(vm.load(instruction.a as usize)),
+        },
+        OpcodeHandler {
+            opcode: Opcode::PushPointer,
+            func: |vm, instruction| vm.op_push::<CHECKED>(vm.load(instruction.a as usize)),
+        },
+        OpcodeHandler {
+            opcode: Opcode::PopLocal,
+            func: VMEmulator::op_pop_segment::<LCL, CHECKED>,
+        },
+        OpcodeHandler {
+            opcode: Opcode::PopArgument,
+            func: VMEmulator::op_pop_segment::<ARG, CHECKED>,
+        },
+        OpcodeHandler {
+            opcode: Opcode::PopThis,
+            func: VMEmulator::op_pop_segment::<THIS, CHECKED>,
+        },
+        OpcodeHandler {
+            opcode: Opcode::PopThat,
+            func: VMEmulator::op_pop_segment::<THAT, CHECKED>,
+        },
+        OpcodeHandler {
+            opcode: Opcode::PopStatic,
+            func: VMEmulator::op_pop_ram::<CHECKED>,
+        },
+        OpcodeHandler {
+            opcode: Opcode::PopTemp,
+            func: VMEmulator::op_pop_ram::<CHECKED>,
+        },
+        OpcodeHandler {
+            opcode: Opcode::PopPointer,
+            func: VMEmulator::op_pop_ram::<CHECKED>,
+        },
+        OpcodeHandler {
+            opcode: Opcode::CopyConstantToRam,
+            func: |vm, instruction| {
+                vm.store(instruction.b as usize, instruction.a as i32);
+                vm.op_next()
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::CopyConstantToSegment,
+            func: |vm, instruction| {
+                let to = vm.segment_address(instruction.b);
+                vm.store(to, instruction.a as i32);
+                vm.op_next()
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::CopyRamToRam,
+            func: |vm, instruction| {
+                vm.store(instruction.b as usize, vm.load(instruction.a as usize));
+                vm.op_next()
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::CopyRamToSegment,
+            func: |vm, instruction| {
+                let to = vm.segment_address(instruction.b);
+                vm.store(to, vm.load(instruction.a as usize));
+                vm.op_next()
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::CopySegmentToRam,
+            func: |vm, instruction| {
+                let from = vm.segment_address(instruction.a);
+                vm.store(instruction.b as usize, vm.load(from));
+                vm.op_next()
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::CopySegmentToSegment,
+            func: |vm, instruction| {
+                let from = vm.segment_address(instruction.a);
+                let to = vm.segment_address(instruction.b);
+                vm.store(to, vm.load(from));
+                vm.op_next()
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::Neg,
+            func: |vm, _| vm.op_unary::<CHECKED>(|a| -a),
+        },
+        OpcodeHandler {
+            opcode: Opcode::Not,
+            func: |vm, _| vm.op_unary::<CHECKED>(|a| !a),
+        },
+        OpcodeHandler {
+            opcode: Opcode::Add,
+            func: |vm, _| vm.op_binary::<CHECKED>(|b, a| b + a),
+        },
+        OpcodeHandler {
+            opcode: Opcode::Sub,
+            func: |vm, _| vm.op_binary::<CHECKED>(|b, a| b - a),
+        },
+        OpcodeHandler {
+            opcode: Opcode::And,
+            func: |vm, _| vm.op_binary::<CHECKED>(|b, a| b & a),
+        },
+        OpcodeHandler {
+            opcode: Opcode::Or,
+            func: |vm, _| vm.op_binary::<CHECKED>(|b, a| b | a),
+        },
+        OpcodeHandler {
+            opcode: Opcode::Eq,
+            func: |vm, _| vm.op_binary::<CHECKED>(|b, a| if b == a { -1 } else { 0 }),
+        },
+        OpcodeHandler {
+            opcode: Opcode::Lt,
+            func: |vm, _| vm.op_binary::<CHECKED>(|b, a| if b < a { -1 } else { 0 }),
+        },
+        OpcodeHandler {
+            opcode: Opcode::Gt,
+            func: |vm, _| vm.op_binary::<CHECKED>(|b, a| if b > a { -1 } else { 0 }),
+        },
+        OpcodeHandler {
+            opcode: Opcode::Goto,
+            func: |vm, instruction| {
+                vm.frame_mut().index = instruction.a as usize;
+                Ok(None)
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::If,
+            func: |vm, instruction| {
+                if vm.pop::<CHECKED>()? == -1 {
+                    vm.frame_mut().index = instruction.a as usize;
+                } else {
+                    vm.frame_mut().index += 1;
+                }
+                Ok(None)
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::Function,
+            func: |vm, instruction| {
+                if !CHECKED {
+                    vm.check_stack_room(instruction.a as usize)?;
+                }
+                for _ in 0..instruction.a {
+                    vm.push_global_stack(0);
+                }
+                vm.op_next()
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::Call,
+            func: |vm, instruction| {
+                let function = vm.linked.code.functions[instruction.a as usize].function;
+                vm.exec_call(function, instruction.b as usize)?;
+                Ok(None)
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::TailCall,
+            func: |vm, instruction| {
+                vm.sync_stack_size::<CHECKED>();
+                let function = vm.linked.code.functions[instruction.a as usize].function;
+                if vm.call_stack.len() > 1 {
+                    vm.exec_tail_call(function, instruction.b as usize)?;
+                } else {
+                    vm.exec_call(function, instruction.b as usize)?;
+                }
+                Ok(None)
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::CallInternal,
+            func: |vm, instruction| {
+                vm.sync_stack_size::<CHECKED>();
+                let internal_func = &INTERNALS[instruction.a as usize];
+                if internal_func.num_args != instruction.b as usize {
+                    panic!("Wrong number of args passed to {}", internal_func.name);
+                }
+                (internal_func.func)(vm)?;
+                vm.op_next()
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::Return,
+            func: |vm, _| {
+                if vm.call_stack.len() == 1 {
+                    return Ok(Some(vm.peek_stack()));
+                }
+                vm.sync_stack_size::<CHECKED>();
+                vm.exec_return()?;
+                Ok(None)
+            },
+        },
+        OpcodeHandler {
+            opcode: Opcode::Trap,
+            func: |vm, instruction| Err(vm.linked.code.traps[instruction.a as usize].clone()),
+        },
+    ]
+}
+
+const HANDLERS: [OpcodeHandler; NUM_OPCODES] = handler_table::<true>();
+const UNCHECKED_HANDLERS: [OpcodeHandler; NUM_OPCODES] = handler_table::<false>();
+
+/// Whether two functions, possibly from different programs, have the same
+/// commands. Calls are compared by the name of the function they call, since
+/// the same function can have a different reference in each program.
+fn same_code(
+    a_program: &VMProgram,
+    a: &InCodeFuncRef,
+    b_program: &VMProgram,
+    b: &InCodeFuncRef,
+) -> bool {
+    let (a, b) = (a_program.get_vmfunction(a), b_program.get_vmfunction(b));
+    let same_function = |a: &FunctionRef, b: &FunctionRef| {
+        a_program.get_function_name(a) == b_program.get_function_name(b)
+    };
+    a.num_locals == b.num_locals
+        && a.commands.len() == b.commands.len()
+        && a.commands
+            .iter()
+            .zip(b.commands.iter())
+            .all(|commands| match commands {
+                (Command::Function(a, _), Command::Function(b, _))
+                | (Command::Call(a, _), Command::Call(b, _))
+                | (Command::TailCall(a, _), Command::TailCall(b, _)) => {
+                    commands.0 == commands.1 || same_function(a, b)
+                }
+                (a, b) => a == b,
+            })
+}
+
 pub struct VMEmulator {
-    program: VMProgram,
-    ram: [i32; RAM_SIZE],
+    linked: Arc<LinkedProgram>,
+    ram: [i32; RAM_MASK + 1],
     call_stack: Vec<VMStackFrame>,
     step_counter: usize,
     profiler: VMProfiler,
+    screen_changes: ScreenChanges,
 }
 
-const SP: usize = 0;
-const LCL: usize = 1;
-const ARG: usize = 2;
-const THIS: usize = 3;
-const THAT: usize = 4;
-
 impl VMEmulator {
     pub fn empty() -> VMEmulator {
-        VMEmulator {
-            program: VMProgram::empty(),
-            ram: [0; RAM_SIZE],
-            call_stack: Vec::new(),
-            step_counter: 0,
-            profiler: VMProfiler::new(),
-        }
+        VMEmulator::with_program(Arc::new(LinkedProgram::empty()))
     }
+
     pub fn new(program: VMProgram) -> VMEmulator {
+        VMEmulator::with_program(Arc::new(LinkedProgram::new(program)))
+    }
+
+    /// Creates an emulator that runs a shared program. Emulators created from
+    /// the same `Arc` share all of the program's code.
+    pub fn with_program(linked: Arc<LinkedProgram>) -> VMEmulator {
         VMEmulator {
-            program,
-            ram: [0; RAM_SIZE],
+            linked,
+            ram: [0; RAM_MASK + 1],
             call_stack: Vec::new(),
             step_counter: 0,
             profiler: VMProfiler::new(),
+            screen_changes: ScreenChanges::new(),
+        }
+    }
+
+    pub fn program(&self) -> &Arc<LinkedProgram> {
+        &self.linked
+    }
+
+    /// Switches a running emulator over to a new version of its program,
+    /// keeping ram and the call stack. This only works if every function on
+    /// the call stack is unchanged and statics are laid out the same way, since
+    /// their return addresses and values stay where they are. Otherwise the
+    /// emulator is left as it was and an error says why.
+    pub fn reload_program(&mut self, linked: Arc<LinkedProgram>) -> Result<(), String> {
+        let (old, new) = (&self.linked.program, &linked.program);
+        let statics = |program: &VMProgram| -> Vec<(usize, usize)> {
+            program
+                .files
+                .iter()
+                .map(|file| (file.static_offset, file.num_statics))
+                .collect()
+        };
+        if statics(old) != statics(new) {
+            return Err("the static variables of the program changed".to_string());
+        }
+
+        let mut functions = Vec::with_capacity(self.call_stack.len());
+        for frame in self.call_stack.iter() {
+            let name = old
+                .get_function_name(&FunctionRef::InCode(frame.function))
+                .unwrap_or("Unknown Function");
+            let function = match new.get_function_ref(name) {
+                Some(function) => function,
+                None => return Err(format!("running function {} was removed", name)),
+            };
+            if !same_code(old, &frame.function, new, &function) {
+                return Err(format!("running function {} changed", name));
+            }
+            functions.push(function);
         }
+
+        for (frame, function) in self.call_stack.iter_mut().zip(functions) {
+            let threaded = linked.code.function(&function);
+            frame.function = function;
+            frame.code_start = threaded.map_or(usize::MAX, |f| f.start);
+            frame.verified = threaded.map_or(false, |f| f.verified);
+            frame.max_stack_depth = threaded.map_or(0, |f| f.max_stack_depth);
+        }
+        self.linked = linked;
+        // profiled functions are keyed by references into the old program
+        self.profiler = VMProfiler::new();
+        Ok(())
     }
 
     fn frame_mut(&mut self) -> &mut VMStackFrame {
@@ -153,12 +507,35 @@ impl VMEmulator {
         self.call_stack.last().expect("call stack is empty")
     }
 
+    /// Functions that failed stack depth verification, and so run with
+    /// stack checks enabled.
+    pub fn verification_warnings(&self) -> &[String] {
+        &self.linked.code.warnings
+    }
+
     pub fn ram(&self) -> &[i32] {
-        &self.ram
+        &self.ram[..RAM_SIZE]
+    }
+
+    /// The screen memory map, one bit per pixel.
+    pub fn screen(&self) -> &[i32] {
+        &self.ram[SCREEN_START..SCREEN_START + SCREEN_WORDS]
+    }
+
+    /// Returns the screen words written since the last call.
+    pub fn take_screen_changes(&mut self) -> ScreenChanges {
+        self.screen_changes.take()
+    }
+
+    /// Whether any screen word was written since the changes were last
+    /// taken, which is cheap enough to check before every frame.
+    pub fn screen_changed(&self) -> bool {
+        !self.screen_changes.is_empty()
     }
 
     pub fn reset(&mut self) {
-        self.ram = [0; RAM_SIZE];
+        self.ram = [0; RAM_MASK + 1];
+        self.screen_changes = ScreenChanges::new();
         self.call_stack = Vec::new();
         self.step_counter = 0;
         self.init().unwrap();
@@ -167,6 +544,7 @@ impl VMEmulator {
     pub fn set_ram(&mut self, address: usize, value: i32) -> Result<(), &'static str> {
         if address < RAM_SIZE {
             self.ram[address] = value;
+            self.screen_changes.mark(address);
             return Ok(());
         }
         return Err("Address out of range");
@@ -190,6 +568,7 @@ impl VMEmulator {
         &mut self.ram[start..end]
     }
     fn push_global_stack(&mut self, value: i32) {
+        self.screen_changes.mark(self.ram[SP] as usize);
         self.ram[SP] += 1;
         if let Some(last) = self.get_global_stack_mut().last_mut() {
             *last = value;
@@ -239,18 +618,19 @@ impl VMEmulator {
         match segment {
             Segment::Static => {
                 let function = &self.frame().function;
-                let vmfile = self.program.get_file(function);
+                let vmfile = self.linked.program.get_file(function);
                 let start = 16 + vmfile.static_offset;
                 let end = start + vmfile.num_statics;
                 (start, end)
             }
             Segment::Pointer => (THIS, THAT + 1),
             Segment::Temp => (5, 5 + 8),
-            Segment::This => (self.ram[THIS] as usize, self.ram.len()),
-            Segment::That => (self.ram[THAT] as usize, self.ram.len()),
+            Segment::This => (self.ram[THIS] as usize, RAM_SIZE),
+            Segment::That => (self.ram[THAT] as usize, RAM_SIZE),
             Segment::Local => {
                 let start = self.ram[LCL] as usize;
                 let num_locals = self
+                    .linked
                     .program
                     .get_vmfunction(&self.frame().function)
                     .num_locals;
@@ -275,12 +655,31 @@ impl VMEmulator {
         &mut self.ram[start..end]
     }
 
+    fn read_segment(&self, segment: Segment, index: u16) -> Result<i32, String> {
+        match segment {
+            Segment::Constant => Ok(index as i32),
+            _ => self
+                .get_segment(segment)
+                .get(index as usize)
+                .copied()
+                .ok_or_else(|| format!("{:?} index {} is out of bounds", segment, index)),
+        }
+    }
+
+    fn write_segment(&mut self, segment: Segment, index: u16, value: i32) -> Result<(), String> {
+        let (start, _) = self.get_segment_bounds(segment);
+        match self.get_segment_mut(segment).get_mut(index as usize) {
+            Some(slot) => {
+                *slot = value;
+                self.screen_changes.mark(start + index as usize);
+                Ok(())
+            }
+            None => Err(format!("{:?} index {} is out of bounds", segment, index)),
+        }
+    }
+
     fn exec_push(&mut self, segment: Segment, index: u16) -> Result<(), String> {
-        // TODO: check boundaries
-        let value: i32 = match segment {
-            Segment::Constant => index as i32,
-            _ => self.get_segment(segment)[index as usize],
-        };
+        let value = self.read_segment(segment, index)?;
         self.push_stack(value);
         Ok(())
     }
@@ -289,9 +688,7 @@ impl VMEmulator {
         let value = self
             .pop_stack()
             .map_err(|e| format!("exec_pop failed: {}", e))?;
-        // TODO: check boundaries
-        self.get_segment_mut(segment)[index as usize] = value;
-        Ok(())
+        self.write_segment(segment, index, value)
     }
     fn exec_copy_seg(
         &mut self,
@@ -300,12 +697,14 @@ impl VMEmulator {
         to_segment: Segment,
         to_index: u16,
     ) -> Result<(), String> {
-        let value: i32 = match from_segment {
-            Segment::Constant => from_index as i32,
-            _ => self.get_segment(from_segment)[from_index as usize],
-        };
-        self.get_segment_mut(to_segment)[to_index as usize] = value;
-        Ok(())
+        let value = self.read_segment(from_segment, from_index)?;
+        self.write_segment(to_segment, to_index, value)
+    }
+
+    /// The number of arguments internal function `index` takes, or None if
+    /// there's no such function.
+    pub fn internal_num_args(index: usize) -> Option<usize> {
+        INTERNALS.get(index).map(|internal| internal.num_args)
     }
 
     pub fn get_internals() -> HashMap<&'static str, FunctionRef> {
@@ -325,10 +724,35 @@ impl VMEmulator {
         self.ram[ARG] = self.ram[SP] - 5 - num_args as i32;
         self.ram[LCL] = self.ram[SP];
 
-        self.call_stack
-            .push(VMStackFrame::new(function_ref, num_args));
+        let frame = VMStackFrame::new(function_ref, num_args, &self.linked.code);
+        self.call_stack.push(frame);
         Ok(())
     }
+    /// Calls a function in place of the current one, reusing the current
+    /// frame's argument area and saved caller state so that the callee returns
+    /// directly to our caller.
+    fn exec_tail_call(
+        &mut self,
+        function_ref: InCodeFuncRef,
+        num_args: usize,
+    ) -> Result<(), String> {
+        if self.frame().stack_size < num_args {
+            return Err("local stack is empty".to_string());
+        }
+        let arg = self.ram[ARG] as usize;
+        let lcl = self.ram[LCL] as usize;
+        let sp = self.ram[SP] as usize;
+        let mut saved_frame = [0; 5];
+        saved_frame.copy_from_slice(&self.ram[lcl - 5..lcl]);
+        self.ram.copy_within(sp - num_args..sp, arg);
+        self.ram[arg + num_args..arg + num_args + 5].copy_from_slice(&saved_frame);
+        self.ram[LCL] = (arg + num_args + 5) as i32;
+        self.ram[SP] = self.ram[LCL];
+
+        *self.frame_mut() = VMStackFrame::new(function_ref, num_args, &self.linked.code);
+        Ok(())
+    }
+
     fn exec_return(&mut self) -> Result<(), String> {
         let return_value = self.pop_stack()?;
 
@@ -352,8 +776,9 @@ impl VMEmulator {
         self.ram[SP] = 256;
         self.ram[LCL] = 256;
         self.ram[ARG] = 256;
-        if let Some(init_func) = self.program.get_function_ref("Sys.init") {
-            self.call_stack.push(VMStackFrame::new(init_func, 0));
+        if let Some(init_func) = self.linked.program.get_function_ref("Sys.init") {
+            let frame = VMStackFrame::new(init_func, 0, &self.linked.code);
+            self.call_stack.push(frame);
             return Ok(());
         }
         return Err("No Sys.init function found".to_string());
@@ -409,7 +834,11 @@ impl VMEmulator {
 
     fn next_command(&self) -> Option<&Command> {
         if let Some(frame) = self.call_stack.last() {
-            Some(self.program.get_command(&frame.function, frame.index))
+            Some(
+                self.linked
+                    .program
+                    .get_command(&frame.function, frame.index),
+            )
         } else {
             None
         }
@@ -431,11 +860,26 @@ impl VMEmulator {
     }
 
     pub fn profile_step(&mut self) {
-        self.profiler
-            .count_function_step(FunctionRef::InCode(self.frame().function));
+        let frame = self.frame();
+        let vmfunc = self.linked.program.get_vmfunction(&frame.function);
+        match vmfunc.get_inlined_call(frame.index) {
+            Some(inlined) => {
+                let (function, is_start) = (inlined.function, inlined.start == frame.index);
+                self.profiler.count_function_step(function);
+                if is_start {
+                    self.profiler.count_function_call(function);
+                }
+            }
+            None => self
+                .profiler
+                .count_function_step(FunctionRef::InCode(frame.function)),
+        }
+        // the layout goes by whose code ran, wherever it was inlined from
+        let function = self.frame().function;
+        self.profiler.count_code_step(FunctionRef::InCode(function));
         if let Some(command) = self.next_command() {
             let command = *command;
-            if let Command::Call(function_ref, _) = command {
+            if let Command::Call(function_ref, _) | Command::TailCall(function_ref, _) = command {
                 self.profiler.count_function_call(function_ref.clone());
             }
         }
@@ -455,21 +899,31 @@ impl VMEmulator {
                 }
                 self.frame_mut().index += 1;
             }
-            Command::Call(function_ref, num_args) => match function_ref {
-                FunctionRef::InCode(in_code_func_ref) => {
-                    self.exec_call(in_code_func_ref, num_args as usize)
-                        .map_err(|e| format!("failed step {:?}: {}", command, e))?;
-                }
-                FunctionRef::Internal(internal_index) => {
-                    let internal_func = &INTERNALS[internal_index];
-                    if internal_func.num_args != num_args as usize {
-                        panic!("Wrong number of args passed to {}", internal_func.name);
+            Command::TailCall(FunctionRef::InCode(in_code_func_ref), num_args)
+                if self.call_stack.len() > 1 =>
+            {
+                self.exec_tail_call(in_code_func_ref, num_args as usize)
+                    .map_err(|e| format!("failed step {:?}: {}", command, e))?;
+            }
+            // tail calls from the outermost frame have no saved frame to reuse,
+            // so they are executed as regular calls followed by a return.
+            Command::Call(function_ref, num_args) | Command::TailCall(function_ref, num_args) => {
+                match function_ref {
+                    FunctionRef::InCode(in_code_func_ref) => {
+                        self.exec_call(in_code_func_ref, num_args as usize)
+                            .map_err(|e| format!("failed step {:?}: {}", command, e))?;
+                    }
+                    FunctionRef::Internal(internal_index) => {
+                        let internal_func = &INTERNALS[internal_index];
+                        if internal_func.num_args != num_args as usize {
+                            panic!("Wrong number of args passed to {}", internal_func.name);
+                        }
+                        (internal_func.func)(self)
+                            .map_err(|e| format!("failed step {:?}: {}", command, e))?;
+                        self.frame_mut().index += 1;
                     }
-                    (internal_func.func)(self)
-                        .map_err(|e| format!("failed step {:?}: {}", command, e))?;
-                    self.frame_mut().index += 1;
                 }
-            },
+            }
             Command::Return => {
                 if self.call_stack.len() == 1 {
                     // There is nowhere left to return to,
@@ -526,6 +980,140 @@ impl VMEmulator {
         return Ok(None);
     }
 
+    fn op_next(&mut self) -> StepResult {
+        self.frame_mut().index += 1;
+        Ok(None)
+    }
+
+    /// Reads an address computed by the threaded code. The backing array
+    /// covers the whole 15 bit address space, so masking the address stands in
+    /// for a bounds check. Segment indexes are validated when the program is
+    /// loaded, so only `this`/`that` and a runaway stack can reach past RAM_SIZE.
+    #[inline(always)]
+    fn load(&self, address: usize) -> i32 {
+        self.ram[address & RAM_MASK]
+    }
+
+    #[inline(always)]
+    fn store(&mut self, address: usize, value: i32) {
+        self.ram[address & RAM_MASK] = value;
+        self.screen_changes.mark(address & RAM_MASK);
+    }
+
+    fn pop<const CHECKED: bool>(&mut self) -> Result<i32, String> {
+        if CHECKED {
+            return self.pop_stack();
+        }
+        self.ram[SP] -= 1;
+        Ok(self.load(self.ram[SP] as usize))
+    }
+
+    /// Checks that a verified function entered with `num_locals` locals has
+    /// room for its deepest stack, which stands in for the bounds checks its
+    /// pushes skip.
+    fn check_stack_room(&self, num_locals: usize) -> Result<(), String> {
+        let frame = self.frame();
+        if self.ram[SP] as usize + num_locals + frame.max_stack_depth > STACK_END {
+            let function = self.linked.program.get_vmfunction(&frame.function);
+            return Err(format!("Stack overflow in {}", function.name));
+        }
+        Ok(())
+    }
+
+    /// Sets the stack size of a frame running unchecked code from its verified
+    /// stack depth.
+    fn sync_stack_size<const CHECKED: bool>(&mut self) {
+        if !CHECKED {
+            let frame = self.frame();
+            let depth = self.linked.code.depths[frame.code_start + frame.index];
+            self.frame_mut().stack_size = depth as usize;
+        }
+    }
+
+    fn op_push<const CHECKED: bool>(&mut self, value: i32) -> StepResult {
+        if CHECKED {
+            self.push_stack(value);
+        } else {
+            self.store(self.ram[SP] as usize, value);
+            self.ram[SP] += 1;
+        }
+        self.op_next()
+    }
+
+    fn op_push_segment<const REGISTER: usize, const CHECKED: bool>(
+        &mut self,
+        instruction: Instruction,
+    ) -> StepResult {
+        let address = self.ram[REGISTER] as usize + instruction.a as usize;
+        self.op_push::<CHECKED>(self.load(address))
+    }
+
+    fn op_pop_segment<const REGISTER: usize, const CHECKED: bool>(
+        &mut self,
+        instruction: Instruction,
+    ) -> StepResult {
+        let value = self.pop::<CHECKED>()?;
+        let address = self.ram[REGISTER] as usize + instruction.a as usize;
+        self.store(address, value);
+        self.op_next()
+    }
+
+    fn op_pop_ram<const CHECKED: bool>(&mut self, instruction: Instruction) -> StepResult {
+        let value = self.pop::<CHECKED>()?;
+        self.store(instruction.a as usize, value);
+        self.op_next()
+    }
+
+    fn op_unary<const CHECKED: bool>(&mut self, op: fn(i32) -> i32) -> StepResult {
+        let a = self.pop::<CHECKED>()?;
+        self.op_push::<CHECKED>(op(a))
+    }
+
+    fn op_binary<const CHECKED: bool>(&mut self, op: fn(i32, i32) -> i32) -> StepResult {
+        let a = self.pop::<CHECKED>()?;
+        let b = self.pop::<CHECKED>()?;
+        self.op_push::<CHECKED>(op(b, a))
+    }
+
+    fn segment_address(&self, operand: u32) -> usize {
+        let (register, index) = Instruction::unpack_segment_operand(operand);
+        self.ram[register] as usize + index
+    }
+
+    /// Executes the next instruction using the pre-decoded threaded code.
+    /// Behaves exactly like `step`, which remains the reference implementation,
+    /// except that frames of verified functions don't track their stack size.
+    pub fn step_threaded(&mut self) -> StepResult {
+        self.step_counter += 1;
+        let frame = self
+            .call_stack
+            .last()
+            .ok_or("No more commands to execute".to_string())?;
+        let instruction = self.linked.code.instructions[frame.code_start + frame.index];
+        let handlers = if frame.verified {
+            &UNCHECKED_HANDLERS
+        } else {
+            &HANDLERS
+        };
+        (handlers[instruction.opcode as usize].func)(self, instruction)
+            .map_err(|e| format!("failed step {:?}: {}", instruction, e))
+    }
+
+    pub fn run_threaded(&mut self, max_steps: usize) -> Result<i32, String> {
+        self.init()?;
+        loop {
+            if let Some(result) = self.step_threaded()? {
+                return Ok(result);
+            }
+            if self.step_counter > max_steps {
+                return Err(format!(
+                    "Program failed to finish within {} steps",
+                    max_steps
+                ));
+            }
+        }
+    }
+
     pub fn debug(&self) -> String {
         use std::fmt::Write;
         let mut s = String::new();
@@ -533,10 +1121,20 @@ impl VMEmulator {
         writeln!(&mut s, "Call Stack:").unwrap();
         for frame in self.call_stack.iter() {
             let func_name = self
+                .linked
                 .program
                 .get_function_name(&frame.function.to_function_ref())
                 .unwrap_or("Unknown Function");
             writeln!(&mut s, "  {}[{}]", func_name, &frame.index).unwrap();
+            let logical = logical_function(&self.linked.program, &frame.function, frame.index);
+            if logical != frame.function.to_function_ref() {
+                let inlined_name = self
+                    .linked
+                    .program
+                    .get_function_name(&logical)
+                    .unwrap_or("Unknown Function");
+                writeln!(&mut s, "  {} (inlined)", inlined_name).unwrap();
+            }
         }
         writeln!(&mut s, "Function Stack: {:?}", self.get_stack()).unwrap();
         let segments = [
@@ -556,11 +1154,113 @@ impl VMEmulator {
             .unwrap();
         }
         if let Some(command) = self.next_command() {
-            writeln!(&mut s, "Next Command: {}", command.to_string(&self.program)).unwrap();
+            writeln!(
+                &mut s,
+                "Next Command: {}",
+                command.to_string(&self.linked.program)
+            )
+            .unwrap();
         }
         return s;
     }
 
+    /// The command the next step will run, as vm code.
+    pub fn next_command_text(&self) -> Option<String> {
+        self.next_command()
+            .map(|command| command.to_string(&self.linked.program))
+    }
+
+    /// The names of the program's functions, in the order `debug_snapshot`
+    /// numbers them.
+    pub fn function_names(&self) -> Vec<&str> {
+        self.linked
+            .program
+            .files
+            .iter()
+            .flat_map(|file| file.functions.iter().map(|function| &function.name[..]))
+            .collect()
+    }
+
+    fn function_number(&self, func_ref: &FunctionRef) -> i32 {
+        match func_ref {
+            FunctionRef::InCode(in_code_ref) => {
+                let files = &self.linked.program.files[..in_code_ref.file_index()];
+                let before: usize = files.iter().map(|file| file.functions.len()).sum();
+                (before + in_code_ref.function_index()) as i32
+            }
+            FunctionRef::Internal(_) => -1,
+        }
+    }
+
+    /// Writes what `debug` shows into `out` as plain numbers, for callers that
+    /// format it themselves, and only when they need to. The layout is:
+    ///
+    /// - the step counter, as its low and high 32 bits
+    /// - SP, LCL, ARG, THIS and THAT
+    /// - the number of call frames, then for each frame its function, the
+    ///   function inlined at its position or -1, and its command index
+    /// - the stack, static, temp, local, argument and pointer segments, each
+    ///   as its length followed by its values
+    ///
+    /// Functions are numbered in the order of `function_names`.
+    pub fn debug_snapshot(&self, out: &mut Vec<i32>) {
+        out.clear();
+        let step = self.step_counter as u64;
+        out.push(step as i32);
+        out.push((step >> 32) as i32);
+        out.extend_from_slice(&self.ram[SP..=THAT]);
+        out.push(self.call_stack.len() as i32);
+        for frame in self.call_stack.iter() {
+            let function = frame.function.to_function_ref();
+            let logical = logical_function(&self.linked.program, &frame.function, frame.index);
+            out.push(self.function_number(&function));
+            out.push(if logical != function {
+                self.function_number(&logical)
+            } else {
+                -1
+            });
+            out.push(frame.index as i32);
+        }
+        let segments = [
+            Segment::Static,
+            Segment::Temp,
+            Segment::Local,
+            Segment::Argument,
+            Segment::Pointer,
+        ];
+        let has_frame = !self.call_stack.is_empty();
+        let stack = if has_frame { self.get_stack() } else { &[] };
+        out.push(stack.len() as i32);
+        out.extend_from_slice(stack);
+        for segment in segments.iter() {
+            let values = match segment {
+                Segment::Static | Segment::Local | Segment::Argument if !has_frame => &[],
+                _ => self.get_segment(*segment),
+            };
+            out.push(values.len() as i32);
+            out.extend_from_slice(values);
+        }
+    }
+
+    /// The steps and calls counted by `profile_step` so far, by function name,
+    /// which can be saved and used to lay out the program on later runs.
+    pub fn profile(&self) -> Profile {
+        let mut profile = Profile::new();
+        for (func_ref, stats) in self.profiler.function_stats.iter() {
+            if let Some(name) = self.linked.program.get_function_name(func_ref) {
+                profile.functions.insert(
+                    name.to_string(),
+                    FunctionProfile {
+                        calls: stats.num_calls,
+                        steps: stats.num_steps,
+                        code_steps: stats.num_code_steps,
+                    },
+                );
+            }
+        }
+        profile
+    }
+
     pub fn profiler_stats(&self) -> String {
         let mut stats = self.profiler.function_stats.iter().collect::<Vec<_>>();
         stats.sort_by_key(|(_func_ref, stats)| stats.num_steps);
@@ -574,7 +1274,7 @@ impl VMEmulator {
             .map(|(func_ref, stats)| {
                 format!(
                     "{:.<30} {:>10} {:>10} {:>10} {:>10.2}%",
-                    if let Some(name) = self.program.get_function_name(func_ref) {
+                    if let Some(name) = self.linked.program.get_function_name(func_ref) {
                         name
                     } else {
                         "UNKNOWN_FUNC"
@@ -720,7 +1420,7 @@ mod tests {
                 assert_eq!(vm.ram[16], 10, "static segment should be at ram[16]");
 
                 // call into another function...
-                vm.exec_call(vm.program.get_function_ref("Main.main").unwrap(), 0)
+                vm.exec_call(vm.linked.program.get_function_ref("Main.main").unwrap(), 0)
                     .unwrap();
                 assert_eq!(vm.get_segment(Segment::Static), &[0, 0, 0, 0, 0]);
                 vm.push_stack(25);
@@ -769,7 +1469,7 @@ mod tests {
             fn this_that_segment() {
                 let mut vm = setup_vm();
                 assert_eq!(vm.get_segment(Segment::Pointer), &[0, 0]);
-                assert_eq!(vm.get_segment(Segment::This), &vm.ram);
+                assert_eq!(vm.get_segment(Segment::This), vm.ram());
 
                 vm.ram[3000] = 10;
                 vm.ram[4000] = 25;
@@ -801,7 +1501,7 @@ mod tests {
             #[test]
             fn argument_segment() {
                 let mut vm = setup_vm();
-                vm.exec_call(vm.program.get_function_ref("Main.main").unwrap(), 2)
+                vm.exec_call(vm.linked.program.get_function_ref("Main.main").unwrap(), 2)
                     .unwrap();
                 vm.ram[2] = 270;
                 vm.ram[270] = 13;
@@ -856,7 +1556,7 @@ mod tests {
                 }
                 vm.push_stack(2);
                 vm.push_stack(3);
-                vm.exec_call(vm.program.get_function_ref("Main.add").unwrap(), 2)
+                vm.exec_call(vm.linked.program.get_function_ref("Main.add").unwrap(), 2)
                     .unwrap();
                 assert_eq!(
                     vm.get_segment(Segment::Argument),
@@ -912,6 +1612,194 @@ mod tests {
         );
     }
 
+    #[test]
+    fn test_debug_snapshot() {
+        let program = VMProgram::new(&vec![(
+            "Sys.vm",
+            "
+            function Sys.init 0
+                push constant 7
+                call Sys.f 1
+            return
+
+            function Sys.f 1
+                push constant 3
+                push argument 0
+            return
+            ",
+        )])
+        .unwrap();
+        let mut vm = VMEmulator::new(program);
+        vm.init().unwrap();
+        while vm.call_stack.len() < 2 || vm.get_stack().len() < 2 {
+            vm.step().unwrap();
+        }
+        assert_eq!(vm.function_names(), vec!["Sys.init", "Sys.f"]);
+
+        let mut out = Vec::new();
+        vm.debug_snapshot(&mut out);
+        let ram = &vm.ram;
+        let mut expected = vec![vm.step_counter as i32, 0];
+        expected.extend_from_slice(&[ram[SP], ram[LCL], ram[ARG], 0, 0]);
+        expected.extend_from_slice(&[2, 0, -1, vm.call_stack[0].index as i32]);
+        expected.extend_from_slice(&[1, -1, vm.call_stack[1].index as i32]);
+        expected.extend_from_slice(&[2, 3, 7]); // stack
+        expected.extend_from_slice(&[0]); // static
+        expected.extend_from_slice(&[8, 0, 0, 0, 0, 0, 0, 0, 0]); // temp
+        expected.extend_from_slice(&[1, 0]); // local
+        expected.extend_from_slice(&[1, 7]); // argument
+        expected.extend_from_slice(&[2, 0, 0]); // pointer
+        assert_eq!(out, expected);
+    }
+
+    #[test]
+    fn test_screen_changed() {
+        let program = VMProgram::new(&vec![(
+            "Sys.vm",
+            "
+            function Sys.init 0
+                push constant 16384
+                pop pointer 1
+                push constant 1
+                pop that 0
+                label LOOP
+                goto LOOP
+            return
+            ",
+        )])
+        .unwrap();
+        let mut vm = VMEmulator::new(program);
+        vm.init().unwrap();
+        assert!(vm.screen_changed(), "the first frame is drawn in full");
+        vm.take_screen_changes();
+        assert!(!vm.screen_changed());
+        while vm.ram[SCREEN_START] == 0 {
+            vm.step().unwrap();
+        }
+        assert!(vm.screen_changed());
+        assert_eq!(vm.take_screen_changes().iter().collect::<Vec<_>>(), vec![0]);
+        for _ in 0..10 {
+            vm.step().unwrap();
+        }
+        assert!(!vm.screen_changed());
+    }
+
+    #[test]
+    fn test_profile_counts_inlined_code() {
+        let program = VMProgram::link(&vec![(
+            "Sys.vm",
+            "
+            function Sys.init 0
+                push constant 3
+                call Sys.double 1
+                pop temp 0
+                push constant 0
+            return
+
+            function Sys.double 0
+                push argument 0
+                push argument 0
+                add
+            return",
+        )])
+        .unwrap();
+        let mut vm = VMEmulator::new(program);
+        vm.init().unwrap();
+        let mut steps = 0;
+        loop {
+            vm.profile_step();
+            steps += 1;
+            if vm.step().unwrap().is_some() {
+                break;
+            }
+        }
+        let profile = vm.profile();
+        // Sys.double ran, but only as code inlined into Sys.init
+        let double = profile.get("Sys.double");
+        assert_eq!(double.calls, 1);
+        assert!(double.steps > 0);
+        assert_eq!(double.code_steps, 0);
+        assert_eq!(profile.get("Sys.init").code_steps, steps);
+    }
+
+    #[test]
+    fn test_shared_program() {
+        let program = VMProgram::new(&vec![(
+            "Sys.vm",
+            "
+            function Sys.init 0
+                push static 0
+                push constant 1
+                add
+                pop static 0
+                push static 0
+            return
+            ",
+        )])
+        .unwrap();
+        let linked = Arc::new(LinkedProgram::new(program));
+        let mut a = VMEmulator::with_program(linked.clone());
+        let mut b = VMEmulator::with_program(linked.clone());
+        assert_eq!(a.run(1000), Ok(1));
+        assert_eq!(b.run_threaded(1000), Ok(1));
+        assert!(Arc::ptr_eq(a.program(), b.program()));
+        assert_eq!(Arc::strong_count(&linked), 3);
+    }
+
+    #[test]
+    fn test_reload_program() {
+        let program = |value: &str, init_locals: u16| {
+            let files = vec![
+                (
+                    "Sys.vm",
+                    format!(
+                        "
+                        function Sys.init {}
+                            label LOOP
+                            call Value.get 0
+                            pop static 0
+                            push static 1
+                            push constant 1
+                            add
+                            pop static 1
+                            push static 1
+                            push constant 10
+                            lt
+                            if-goto LOOP
+                            push static 0
+                        return",
+                        init_locals
+                    ),
+                ),
+                (
+                    "Value.vm",
+                    format!("function Value.get 0\npush constant {}\nreturn", value),
+                ),
+            ];
+            let files: Vec<(&str, &str)> = files.iter().map(|(a, b)| (*a, &b[..])).collect();
+            Arc::new(LinkedProgram::new(VMProgram::new(&files).unwrap()))
+        };
+
+        let mut vm = VMEmulator::with_program(program("1", 0));
+        vm.init().unwrap();
+        for _ in 0..20 {
+            vm.step_threaded().unwrap();
+        }
+        let ram = vm.ram().to_vec();
+        assert_eq!(
+            vm.reload_program(program("1", 1)).err(),
+            Some("running function Sys.init changed".to_string())
+        );
+        vm.reload_program(program("7", 0)).unwrap();
+        assert_eq!(vm.ram(), &ram[..], "Expected ram to be kept");
+        let result = loop {
+            if let Some(result) = vm.step_threaded().unwrap() {
+                break result;
+            }
+        };
+        assert_eq!(result, 7);
+    }
+
     #[test]
     fn test_math_divide() {
         let program = VMProgram::with_internals(
@@ -937,6 +1825,198 @@ mod tests {
         );
     }
 
+    #[test]
+    fn test_argument_out_of_bounds() {
+        // a callee reading past the arguments it was passed would fail on the
+        // checked path but read the caller's frame on the threaded one, so
+        // such programs don't load at all
+        let load = |init: &str| {
+            VMProgram::new(&vec![
+                ("Sys.vm", init),
+                (
+                    "Foo.vm",
+                    "
+                    function Foo.f 0
+                        push argument 1
+                        push constant 1
+                        add
+                    return",
+                ),
+            ])
+        };
+        let err = load(
+            "
+            function Sys.init 0
+                call Foo.f 0
+                pop static 0
+                push constant 0
+            return",
+        )
+        .err()
+        .unwrap_or_default();
+        assert_eq!(err, "Sys.init calls Foo.f with 0 arguments but it reads 2");
+        let err = load("function Sys.init 0\npush argument 0\nreturn")
+            .err()
+            .unwrap_or_default();
+        assert_eq!(err, "Sys.init takes no arguments but it reads 1");
+
+        // with enough arguments both paths agree
+        let program = load(
+            "
+            function Sys.init 0
+                push constant 5
+                push constant 7
+                call Foo.f 2
+                pop static 0
+                push constant 0
+            return",
+        )
+        .unwrap();
+        let mut a = VMEmulator::new(program.clone());
+        let mut b = VMEmulator::new(program);
+        assert_eq!(a.run(100), Ok(0));
+        assert_eq!(b.run_threaded(100), Ok(0));
+        assert_eq!(a.ram[16], 8);
+        assert_eq!(b.ram[16], 8);
+    }
+
+    #[test]
+    fn test_stack_overflow() {
+        let program = VMProgram::new(&vec![(
+            "Sys.vm",
+            "
+            function Sys.init 0
+                call Sys.recurse 0
+            return
+
+            function Sys.recurse 2
+                call Sys.recurse 0
+                push constant 1
+                add
+            return",
+        )])
+        .unwrap();
+        let mut vm = VMEmulator::new(program);
+        let err = vm.run_threaded(100_000).unwrap_err();
+        assert!(
+            err.contains("Stack overflow in Sys.recurse"),
+            "unexpected error: {}",
+            err
+        );
+        assert!(vm.ram[SP] as usize <= STACK_END);
+        assert!(vm.screen().iter().all(|word| *word == 0));
+    }
+
+    #[test]
+    fn test_handlers_match_opcodes() {
+        for (i, handler) in HANDLERS.iter().enumerate() {
+            assert_eq!(
+                handler.opcode as usize, i,
+                "{:?} is out of order",
+                handler.opcode
+            );
+        }
+    }
+
+    #[test]
+    fn test_step_threaded_matches_step() {
+        let mut program = VMProgram::with_internals(
+            &vec![
+                (
+                    "Sys.vm",
+                    "
+                    function Sys.init 2
+                        push constant 2000
+                        pop pointer 1
+                        push constant 0
+                        pop local 0
+                        label LOOP
+                        push local 0
+                        push constant 20
+                        lt
+                        not
+                        if-goto END
+                        push local 0
+                        push local 0
+                        call Main.square 1
+                        call Main.store 2
+                        pop temp 0
+                        push local 0
+                        push constant 1
+                        add
+                        pop local 0
+                        goto LOOP
+                        label END
+                        push local 0
+                        push constant 0
+                        call Main.sum 2
+                    return",
+                ),
+                (
+                    "Main.vm",
+                    "
+                    function Main.square 0
+                        push argument 0
+                        push argument 0
+                        call Math.multiply 2
+                    return
+
+                    function Main.store 1
+                        push argument 0
+                        pop local 0
+                        push argument 1
+                        push pointer 1
+                        push local 0
+                        add
+                        pop pointer 1
+                        pop that 0
+                        push constant 0
+                    return
+
+                    function Main.sum 0
+                        push argument 0
+                        push constant 0
+                        eq
+                        if-goto DONE
+                        push argument 0
+                        push constant 1
+                        sub
+                        push argument 1
+                        push constant 2000
+                        push argument 0
+                        add
+                        pop pointer 1
+                        push that 0
+                        add
+                        call Main.sum 2
+                    return
+                        label DONE
+                        push argument 1
+                    return",
+                ),
+            ],
+            Some(VMEmulator::get_internals()),
+        )
+        .unwrap();
+        program.eliminate_tail_calls();
+
+        let mut reference = VMEmulator::new(program.clone());
+        let mut threaded = VMEmulator::new(program);
+        reference.init().unwrap();
+        threaded.init().unwrap();
+        loop {
+            let expected = reference.step().unwrap();
+            assert_eq!(threaded.step_threaded().unwrap(), expected);
+            assert_eq!(&threaded.ram[..], &reference.ram[..]);
+            assert_eq!(threaded.call_stack.len(), reference.call_stack.len());
+            assert_eq!(threaded.frame().index, reference.frame().index);
+            if let Some(result) = expected {
+                assert_eq!(result, (1..20).map(|i| i * i).sum());
+                break;
+            }
+        }
+    }
+
     #[test]
     fn test_vmemulator_init() {
         let program = VMProgram::new(&vec![(
@@ -0,0 +1,692 @@
+use super::vmcommand::{Command, FunctionRef, InCodeFuncRef, InlinedCall, Segment, VMProgram};
+use super::vmemulator::VMEmulator;
+use super::vmparser::StreamedTokens;
+use super::vmverifier::verify_stack_depths;
+use std::cmp;
+use std::collections::HashMap;
+
+/// Largest callee body (in commands, not counting the function declaration)
+/// that will be substituted into its callers.
+pub const MAX_INLINE_COMMANDS: usize = 16;
+
+/// Bumped whenever a pass in `VMProgram::optimize` changes what it produces,
+/// so that programs cached by an older pipeline are linked again.
+pub const LINK_VERSION: u32 = 2;
+
+/// A small function without any calls of its own, which can be copied
+/// directly into the body of its callers.
+struct LeafFunction {
+    file_index: usize,
+    num_locals: u16,
+    num_args_used: u16,
+    uses_statics: bool,
+    writes_pointer: [bool; 2],
+    commands: Vec<Command>,
+}
+
+/// Checks that every `return` in the function is reached with exactly one
+/// value (the return value) on the function stack, so that replacing it with
+/// a jump leaves the caller's stack exactly as a real return would.
+fn returns_single_value(commands: &[Command]) -> bool {
+    match verify_stack_depths(commands) {
+        Ok(stack) => commands
+            .iter()
+            .zip(stack.depths.iter())
+            .all(|(command, depth)| *command != Command::Return || depth.map_or(true, |d| d == 1)),
+        Err(_) => false,
+    }
+}
+
+impl LeafFunction {
+    fn from_commands(
+        file_index: usize,
+        num_locals: usize,
+        commands: &[Command],
+        max_commands: usize,
+    ) -> Option<LeafFunction> {
+        if commands.len() < 2 || commands.len() - 1 > max_commands {
+            return None;
+        }
+        if commands.last() != Some(&Command::Return) {
+            return None;
+        }
+        let mut leaf = LeafFunction {
+            file_index,
+            num_locals: num_locals as u16,
+            num_args_used: 0,
+            uses_statics: false,
+            writes_pointer: [false, false],
+            commands: commands.to_vec(),
+        };
+        let mut visit = |segment: Segment, index: u16, write: bool| -> bool {
+            match segment {
+                Segment::Argument => {
+                    leaf.num_args_used = cmp::max(leaf.num_args_used, index + 1);
+                }
+                Segment::Local => {
+                    if index as usize >= num_locals {
+                        return false;
+                    }
+                }
+                Segment::Static => leaf.uses_statics = true,
+                Segment::Pointer => {
+                    if index > 1 {
+                        return false;
+                    }
+                    if write {
+                        leaf.writes_pointer[index as usize] = true;
+                    }
+                }
+                Segment::Constant => return !write,
+                _ => {}
+            }
+            true
+        };
+        for command in commands[1..].iter() {
+            let ok = match *command {
+                Command::Call(_, _) | Command::TailCall(_, _) | Command::Function(_, _) => false,
+                Command::Push(segment, index) => visit(segment, index, false),
+                Command::Pop(segment, index) => visit(segment, index, true),
+                Command::CopySeg {
+                    from_segment,
+                    from_index,
+                    to_segment,
+                    to_index,
+                } => visit(from_segment, from_index, false) && visit(to_segment, to_index, true),
+                _ => true,
+            };
+            if !ok {
+                return None;
+            }
+        }
+        if !returns_single_value(&leaf.commands) {
+            return None;
+        }
+        Some(leaf)
+    }
+
+    fn num_saved_pointers(&self) -> u16 {
+        self.writes_pointer.iter().filter(|w| **w).count() as u16
+    }
+
+    /// Number of extra caller locals needed to hold this function's
+    /// arguments, locals and saved pointers when inlined.
+    fn num_slots(&self, num_args: u16) -> u16 {
+        num_args + self.num_locals + self.num_saved_pointers()
+    }
+
+    fn can_inline_into(&self, caller_file_index: usize, num_args: u16) -> bool {
+        num_args >= self.num_args_used
+            && (!self.uses_statics || caller_file_index == self.file_index)
+    }
+
+    /// Appends the body of this function to `out`, with its argument and local
+    /// segments remapped to caller locals starting at `base`.
+    fn expand_into(&self, out: &mut Vec<Command>, base: u16, num_args: u16) {
+        let local_base = base + num_args;
+        let save_base = local_base + self.num_locals;
+        let remap = |segment: Segment, index: u16| -> (Segment, u16) {
+            match segment {
+                Segment::Argument => (Segment::Local, base + index),
+                Segment::Local => (Segment::Local, local_base + index),
+                _ => (segment, index),
+            }
+        };
+
+        for arg in (0..num_args).rev() {
+            out.push(Command::Pop(Segment::Local, base + arg));
+        }
+        for local in 0..self.num_locals {
+            out.push(Command::CopySeg {
+                from_segment: Segment::Constant,
+                from_index: 0,
+                to_segment: Segment::Local,
+                to_index: local_base + local,
+            });
+        }
+        let saved_pointers: Vec<u16> = (0..2_u16)
+            .filter(|i| self.writes_pointer[*i as usize])
+            .collect();
+        for (slot, pointer) in saved_pointers.iter().enumerate() {
+            out.push(Command::CopySeg {
+                from_segment: Segment::Pointer,
+                from_index: *pointer,
+                to_segment: Segment::Local,
+                to_index: save_base + slot as u16,
+            });
+        }
+
+        // command i of the callee (i >= 1) ends up at body_start + i - 1, and the
+        // final return is dropped so that it lands on the pointer restore code.
+        let body_start = out.len();
+        let restore_start = body_start + self.commands.len() - 2;
+        let last = self.commands.len() - 1;
+        for (index, command) in self.commands.iter().enumerate().skip(1) {
+            let command = match *command {
+                Command::Return if index == last => continue,
+                Command::Return => Command::Goto(restore_start),
+                Command::Goto(target) => Command::Goto(body_start + target - 1),
+                Command::If(target) => Command::If(body_start + target - 1),
+                Command::Push(segment, index) => {
+                    let (segment, index) = remap(segment, index);
+                    Command::Push(segment, index)
+                }
+                Command::Pop(segment, index) => {
+                    let (segment, index) = remap(segment, index);
+                    Command::Pop(segment, index)
+                }
+                Command::CopySeg {
+                    from_segment,
+                    from_index,
+                    to_segment,
+                    to_index,
+                } => {
+                    let (from_segment, from_index) = remap(from_segment, from_index);
+                    let (to_segment, to_index) = remap(to_segment, to_index);
+                    Command::CopySeg {
+                        from_segment,
+                        from_index,
+                        to_segment,
+                        to_index,
+                    }
+                }
+                other => other,
+            };
+            out.push(command);
+        }
+
+        for (slot, pointer) in saved_pointers.iter().enumerate() {
+            out.push(Command::CopySeg {
+                from_segment: Segment::Local,
+                from_index: save_base + slot as u16,
+                to_segment: Segment::Pointer,
+                to_index: *pointer,
+            });
+        }
+    }
+}
+
+impl VMProgram {
+    /// Substitutes the bodies of small leaf functions (functions which make no
+    /// calls of their own) directly into their callers, replacing the
+    /// call/return protocol with a few pops into spare caller locals.
+    ///
+    /// Returns the number of call sites that were inlined.
+    pub fn inline_leaf_functions(&mut self, max_commands: usize) -> usize {
+        let mut leaves: HashMap<FunctionRef, LeafFunction> = HashMap::new();
+        for (file_index, file) in self.files.iter().enumerate() {
+            for function in file.functions.iter() {
+                if let Some(leaf) = LeafFunction::from_commands(
+                    file_index,
+                    function.num_locals,
+                    &function.commands,
+                    max_commands,
+                ) {
+                    leaves.insert(function.id, leaf);
+                }
+            }
+        }
+
+        let mut num_inlined = 0;
+        for (file_index, file) in self.files.iter_mut().enumerate() {
+            for function in file.functions.iter_mut() {
+                let is_inlinable = |command: &Command| match command {
+                    Command::Call(func_ref, num_args) => leaves
+                        .get(func_ref)
+                        .map(|leaf| leaf.can_inline_into(file_index, *num_args))
+                        .unwrap_or(false),
+                    _ => false,
+                };
+                if !function.commands.iter().any(is_inlinable) {
+                    continue;
+                }
+
+                let base = function.num_locals as u16;
+                let mut num_extra_locals = 0_u16;
+                let mut commands: Vec<Command> = Vec::new();
+                let mut new_index: Vec<usize> = Vec::with_capacity(function.commands.len());
+                let mut caller_jumps: Vec<usize> = Vec::new();
+                let mut inlined: Vec<InlinedCall> = Vec::new();
+                for command in function.commands.iter() {
+                    new_index.push(commands.len());
+                    match *command {
+                        Command::Call(func_ref, num_args) if is_inlinable(command) => {
+                            let leaf = &leaves[&func_ref];
+                            let start = commands.len();
+                            leaf.expand_into(&mut commands, base, num_args);
+                            inlined.push(InlinedCall {
+                                start,
+                                end: commands.len(),
+                                function: func_ref,
+                            });
+                            num_extra_locals = cmp::max(num_extra_locals, leaf.num_slots(num_args));
+                            num_inlined += 1;
+                        }
+                        Command::Goto(_) | Command::If(_) => {
+                            caller_jumps.push(commands.len());
+                            commands.push(*command);
+                        }
+                        _ => commands.push(*command),
+                    }
+                }
+                for index in caller_jumps {
+                    commands[index] = match commands[index] {
+                        Command::Goto(target) => Command::Goto(new_index[target]),
+                        Command::If(target) => Command::If(new_index[target]),
+                        other => other,
+                    };
+                }
+
+                function.num_locals += num_extra_locals as usize;
+                commands[0] = Command::Function(function.id, function.num_locals as u16);
+                function.commands = commands;
+                function.inlined = inlined;
+            }
+        }
+        num_inlined
+    }
+}
+
+impl VMProgram {
+    /// Turns every call to an in-code function that is immediately followed by
+    /// a return into a tail call, which the emulator executes by reusing the
+    /// caller's frame instead of building a new one on top of it.
+    ///
+    /// Returns the number of tail calls found.
+    pub fn eliminate_tail_calls(&mut self) -> usize {
+        let mut num_tail_calls = 0;
+        for file in self.files.iter_mut() {
+            for function in file.functions.iter_mut() {
+                for i in 1..function.commands.len() {
+                    if let (
+                        Command::Call(func_ref @ FunctionRef::InCode(_), num_args),
+                        Command::Return,
+                    ) = (function.commands[i - 1], function.commands[i])
+                    {
+                        function.commands[i - 1] = Command::TailCall(func_ref, num_args);
+                        num_tail_calls += 1;
+                    }
+                }
+            }
+        }
+        num_tail_calls
+    }
+}
+
+/// Functions removed by `VMProgram::eliminate_dead_functions`.
+#[derive(Debug, Default, PartialEq, Clone)]
+pub struct DeadFunctions {
+    pub names: Vec<String>,
+    pub num_commands: usize,
+}
+
+impl VMProgram {
+    /// Removes every in-code function that can't be reached by following calls
+    /// from `entry_point`, such as the parts of the OS a program doesn't use,
+    /// along with code for functions that are implemented internally. Files are
+    /// kept even when all of their functions are removed, so that static
+    /// addresses don't change.
+    ///
+    /// Does nothing if there is no `entry_point` function.
+    pub fn eliminate_dead_functions(&mut self, entry_point: &str) -> DeadFunctions {
+        let mut dead = DeadFunctions::default();
+        let entry_point = match self.get_function_ref(entry_point) {
+            Some(entry_point) => entry_point,
+            None => return dead,
+        };
+
+        let mut reachable: Vec<Vec<bool>> = self
+            .files
+            .iter()
+            .map(|file| vec![false; file.functions.len()])
+            .collect();
+        let mut stack = vec![entry_point];
+        reachable[entry_point.file_index()][entry_point.function_index()] = true;
+        while let Some(func_ref) = stack.pop() {
+            let function = self.get_vmfunction(&func_ref);
+            let calls = function
+                .commands
+                .iter()
+                .filter_map(|command| match command {
+                    Command::Call(func_ref, _) | Command::TailCall(func_ref, _) => Some(func_ref),
+                    _ => None,
+                });
+            // inlined functions are still needed to name the code they
+            // contributed in profiles and errors
+            let inlined = function.inlined.iter().map(|call| &call.function);
+            for callee in calls.chain(inlined) {
+                if let FunctionRef::InCode(callee) = callee {
+                    // calls to missing functions point past the end of the
+                    // program and trap when they run
+                    if let Some(seen) = reachable
+                        .get_mut(callee.file_index())
+                        .and_then(|file| file.get_mut(callee.function_index()))
+                    {
+                        if !*seen {
+                            *seen = true;
+                            stack.push(*callee);
+                        }
+                    }
+                }
+            }
+        }
+
+        let mut new_index: Vec<Vec<Option<usize>>> = Vec::new();
+        for (file, reachable) in self.files.iter_mut().zip(reachable.iter()) {
+            let mut num_kept = 0;
+            new_index.push(
+                reachable
+                    .iter()
+                    .map(|reachable| {
+                        if !*reachable {
+                            return None;
+                        }
+                        num_kept += 1;
+                        Some(num_kept - 1)
+                    })
+                    .collect(),
+            );
+            let mut functions = reachable.iter();
+            file.functions.retain(|function| {
+                let keep = *functions.next().unwrap();
+                if !keep {
+                    dead.names.push(function.name.clone());
+                    dead.num_commands += function.commands.len();
+                }
+                keep
+            });
+        }
+        if dead.names.is_empty() {
+            return dead;
+        }
+
+        let remap = |func_ref: InCodeFuncRef| -> Option<InCodeFuncRef> {
+            new_index
+                .get(func_ref.file_index())
+                .and_then(|file| file.get(func_ref.function_index()))
+                .map(|index| index.map(|index| InCodeFuncRef::new(func_ref.file_index(), index)))
+                // leave references to missing functions alone
+                .unwrap_or(Some(func_ref))
+        };
+        let remap_ref = |func_ref: FunctionRef| -> FunctionRef {
+            match func_ref {
+                FunctionRef::InCode(in_code_ref) => FunctionRef::InCode(
+                    remap(in_code_ref).expect("reachable code calls a removed function"),
+                ),
+                internal => internal,
+            }
+        };
+        for file in self.files.iter_mut() {
+            for function in file.functions.iter_mut() {
+                function.id = remap_ref(function.id);
+                for command in function.commands.iter_mut() {
+                    *command = match *command {
+                        Command::Function(func_ref, num_locals) => {
+                            Command::Function(remap_ref(func_ref), num_locals)
+                        }
+                        Command::Call(func_ref, num_args) => {
+                            Command::Call(remap_ref(func_ref), num_args)
+                        }
+                        Command::TailCall(func_ref, num_args) => {
+                            Command::TailCall(remap_ref(func_ref), num_args)
+                        }
+                        other => other,
+                    };
+                }
+                for call in function.inlined.iter_mut() {
+                    call.function = remap_ref(call.function);
+                }
+            }
+        }
+        self.function_table.remap_in_code(remap);
+        dead
+    }
+
+    /// Parses the given files and applies every link time optimization, to
+    /// produce the program the emulator runs.
+    pub fn link(files: &Vec<(&str, &str)>) -> Result<VMProgram, String> {
+        let program = VMProgram::with_internals(files, Some(VMEmulator::get_internals()))?;
+        Ok(program.optimize())
+    }
+
+    /// Like `link`, for files that were tokenized with a `TokenStream`.
+    pub fn link_streams(files: &[(String, StreamedTokens)]) -> Result<VMProgram, String> {
+        let program = VMProgram::from_streams(files, Some(VMEmulator::get_internals()))?;
+        Ok(program.optimize())
+    }
+
+    fn optimize(mut self) -> VMProgram {
+        self.dead_functions = self.eliminate_dead_functions("Sys.init");
+        self.inline_leaf_functions(MAX_INLINE_COMMANDS);
+        self.eliminate_tail_calls();
+        self
+    }
+}
+
+/// Finds the function that the command at `index` of `function` logically
+/// belongs to, taking inlined calls into account.
+pub fn logical_function(
+    program: &VMProgram,
+    function: &InCodeFuncRef,
+    index: usize,
+) -> FunctionRef {
+    program
+        .get_vmfunction(function)
+        .get_inlined_call(index)
+        .map(|call| call.function)
+        .unwrap_or(FunctionRef::InCode(*function))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const PROGRAM: &str = "
+        function Sys.init 1
+            push constant 3000
+            pop pointer 0
+            push constant 7
+            pop this 0
+            push constant 3
+            call Sys.abs 1
+            push constant 3
+            neg
+            call Sys.abs 1
+            add
+            call Sys.getThis 0
+            add
+            push pointer 0
+            add
+        return
+
+        function Sys.abs 0
+            push argument 0
+            push constant 0
+            lt
+            if-goto NEG
+            push argument 0
+            return
+            label NEG
+            push argument 0
+            neg
+        return
+
+        function Sys.getThis 1
+            push constant 4000
+            pop pointer 0
+            push constant 0
+            pop this 0
+            push local 0
+        return
+    ";
+
+    #[test]
+    fn test_inline_leaf_functions() {
+        let mut program = VMProgram::new(&vec![("Sys.vm", PROGRAM)]).unwrap();
+        let expected = VMEmulator::new(program.clone()).run(1000).unwrap();
+        assert_eq!(expected, 3 + 3 + 0 + 3000);
+
+        assert_eq!(program.inline_leaf_functions(MAX_INLINE_COMMANDS), 3);
+        let init = &program.files[0].functions[0];
+        assert!(
+            !init
+                .commands
+                .iter()
+                .any(|c| matches!(c, Command::Call(_, _))),
+            "Expected all calls to be inlined"
+        );
+        assert_eq!(
+            init.num_locals,
+            1 + 1 + 1,
+            "Expected extra locals for the inlined calls"
+        );
+        assert_eq!(init.inlined.len(), 3);
+
+        let abs = program.function_table.get("Sys.abs").unwrap();
+        let site = init.inlined[0];
+        assert_eq!(site.function, abs);
+        assert_eq!(init.get_inlined_call(site.start), Some(&site));
+        assert_eq!(init.get_inlined_call(site.end - 1), Some(&site));
+
+        let result = VMEmulator::new(program).run(1000).unwrap();
+        assert_eq!(
+            result, expected,
+            "Inlining should not change program behavior"
+        );
+    }
+
+    #[test]
+    fn test_inline_skips_non_leaf_functions() {
+        let mut program = VMProgram::new(&vec![(
+            "Sys.vm",
+            "
+            function Sys.init 0
+                push constant 1
+                call Sys.fact 1
+            return
+
+            function Sys.fact 0
+                push argument 0
+                push constant 1
+                gt
+                if-goto RECURSE
+                push constant 1
+                return
+                label RECURSE
+                push argument 0
+                push argument 0
+                push constant 1
+                sub
+                call Sys.fact 1
+                call Math.multiply 2
+            return
+            ",
+        )])
+        .unwrap();
+        assert_eq!(program.inline_leaf_functions(MAX_INLINE_COMMANDS), 0);
+    }
+
+    #[test]
+    fn test_eliminate_dead_functions() {
+        let mut program = VMProgram::with_internals(
+            &vec![
+                (
+                    "Math.vm",
+                    "
+                    function Math.unused 0
+                        push constant 0
+                    return
+
+                    function Math.multiply 2
+                        push constant 0
+                    return",
+                ),
+                (
+                    "Sys.vm",
+                    &format!(
+                        "function Sys.unused 0\ncall Sys.unused 0\nreturn\n{}",
+                        PROGRAM
+                    ),
+                ),
+            ],
+            Some(VMEmulator::get_internals()),
+        )
+        .unwrap();
+        let expected = VMEmulator::new(program.clone()).run(1000).unwrap();
+
+        let dead = program.eliminate_dead_functions("Sys.init");
+        assert_eq!(
+            dead.names,
+            vec!["Math.unused", "Math.multiply", "Sys.unused"]
+        );
+        assert_eq!(dead.num_commands, 3 + 3 + 3);
+        assert_eq!(program.files.len(), 2, "Expected empty files to be kept");
+        assert_eq!(program.files[0].functions.len(), 0);
+        assert_eq!(program.get_function_ref("Sys.unused"), None);
+        let abs = program.get_function_ref("Sys.abs").unwrap();
+        assert_eq!(abs, InCodeFuncRef::new(1, 1));
+        assert_eq!(program.get_vmfunction(&abs).id, FunctionRef::InCode(abs));
+        assert_eq!(
+            program.get_function_name(&abs.to_function_ref()),
+            Some("Sys.abs")
+        );
+        assert_eq!(
+            VMEmulator::new(program.clone()).run(1000).unwrap(),
+            expected
+        );
+
+        assert_eq!(
+            program.eliminate_dead_functions("Sys.init"),
+            DeadFunctions::default()
+        );
+
+        // linking keeps the report
+        let linked = VMProgram::link(&vec![(
+            "Sys.vm",
+            &format!("function Sys.unused 0\nreturn\n{}", PROGRAM)[..],
+        )])
+        .unwrap();
+        assert_eq!(linked.dead_functions.names, vec!["Sys.unused"]);
+    }
+
+    #[test]
+    fn test_eliminate_tail_calls() {
+        let mut program = VMProgram::new(&vec![(
+            "Sys.vm",
+            "
+            function Sys.init 0
+                push constant 5000
+                push constant 0
+                call Sys.sum 2
+            return
+
+            function Sys.sum 1
+                push argument 0
+                push constant 0
+                eq
+                if-goto DONE
+                push argument 0
+                push constant 1
+                sub
+                push argument 1
+                push argument 0
+                add
+                call Sys.sum 2
+                return
+                label DONE
+                push argument 1
+            return
+            ",
+        )])
+        .unwrap();
+        assert_eq!(program.eliminate_tail_calls(), 2);
+        let sum = program.function_table.get("Sys.sum").unwrap();
+        assert_eq!(
+            program.files[0].functions[1].commands[11],
+            Command::TailCall(sum, 2)
+        );
+        // 5000 nested frames would not fit in ram without reusing the caller's frame.
+        let result = VMEmulator::new(program).run(1_000_000).unwrap();
+        assert_eq!(result, 5000 * 5001 / 2);
+    }
+}
@@ -1,7 +1,11 @@
 use super::vmcommand::Segment;
+use std::collections::HashMap;
+use std::io::BufRead;
 
-#[derive(PartialEq, Clone, Debug)]
-pub enum Token {
+/// A single line of vm code. Names borrow from the source text, so parsing
+/// doesn't allocate anything beyond the list of tokens.
+#[derive(PartialEq, Copy, Clone, Debug)]
+pub enum Token<'a> {
     None,
 
     // arithmetic commands
@@ -20,14 +24,14 @@ pub enum Token {
     Pop(Segment, u16),
 
     // goto commands
-    Label(String),
-    If(String),
-    Goto(String),
+    Label(&'a str),
+    If(&'a str),
+    Goto(&'a str),
 
     // function commands
-    Function(String, u16),
+    Function(&'a str, u16),
     Return,
-    Call(String, u16),
+    Call(&'a str, u16),
 }
 
 fn parse_segment(s: &str) -> Result<Segment, String> {
@@ -44,82 +48,69 @@ fn parse_segment(s: &str) -> Result<Segment, String> {
     }
 }
 
-fn parse_line(line: &str) -> Result<Token, String> {
-    let parts: Vec<&str> = line.trim().split_whitespace().collect();
-    match parts.get(0) {
-        None => Ok(Token::None),
-        Some(command) => match *command {
-            // comment
-            "//" => Ok(Token::None),
-
-            // arithmetic commands
-            "neg" => Ok(Token::Neg),
-            "not" => Ok(Token::Not),
-            "add" => Ok(Token::Add),
-            "sub" => Ok(Token::Sub),
-            "and" => Ok(Token::And),
-            "or" => Ok(Token::Or),
-            "eq" => Ok(Token::Eq),
-            "lt" => Ok(Token::Lt),
-            "gt" => Ok(Token::Gt),
-
-            // goto commands
-            "label" | "if-goto" | "goto" => {
-                let arg1 = parts
-                    .get(1)
-                    .ok_or(format!("Missing label in {:?} command", command))?
-                    .to_string();
-                Ok(match *command {
-                    "label" => Token::Label(arg1),
-                    "if-goto" => Token::If(arg1),
-                    "goto" => Token::Goto(arg1),
-                    _ => panic!("This should never happen. Command: {}", command),
-                })
-            }
-            // stack commands
-            "push" | "pop" => {
-                let arg1 = parts
-                    .get(1)
-                    .ok_or(format!("Missing segment in {:?} command", command))?;
-                let arg2 = parts
-                    .get(2)
-                    .ok_or(format!("Missing index in {:?} command", command))?;
-                let segment = parse_segment(arg1)?;
-                let index = arg2
-                    .parse::<u16>()
-                    .map_err(|_| format!("Invalid index {:?} in {:?} command", arg2, command))?;
-                Ok(match *command {
-                    "push" => Token::Push(segment, index),
-                    "pop" => Token::Pop(segment, index),
-                    _ => panic!("This should never happen"),
-                })
-            }
+fn parse_line(line: &str) -> Result<Token<'_>, String> {
+    let code = match line.find("//") {
+        Some(comment_start) => &line[..comment_start],
+        None => line,
+    };
+    let mut parts = code.split_ascii_whitespace();
+    let command = match parts.next() {
+        None => return Ok(Token::None),
+        Some(command) => command,
+    };
+    let mut arg = |name: &str| {
+        parts
+            .next()
+            .ok_or_else(|| format!("Missing {} in {:?} command", name, command))
+    };
+    match command {
+        // arithmetic commands
+        "neg" => Ok(Token::Neg),
+        "not" => Ok(Token::Not),
+        "add" => Ok(Token::Add),
+        "sub" => Ok(Token::Sub),
+        "and" => Ok(Token::And),
+        "or" => Ok(Token::Or),
+        "eq" => Ok(Token::Eq),
+        "lt" => Ok(Token::Lt),
+        "gt" => Ok(Token::Gt),
 
-            // function calling commands
-            "return" => Ok(Token::Return),
-            "function" | "call" => {
-                let arg1 = parts
-                    .get(1)
-                    .ok_or(format!("Missing function name in {:?} command", command))?
-                    .to_string();
-                let arg2 = parts
-                    .get(2)
-                    .ok_or(format!("Missing arg2 in {:?} command", command))?
-                    .to_string();
-                let num = arg2.parse::<u16>().map_err(|_| "Invalid num".to_string())?;
-                Ok(match *command {
-                    "function" => Token::Function(arg1, num),
-                    "call" => Token::Call(arg1, num),
-                    _ => panic!("This should never happen"),
-                })
-            }
+        // goto commands
+        "label" => Ok(Token::Label(arg("label")?)),
+        "if-goto" => Ok(Token::If(arg("label")?)),
+        "goto" => Ok(Token::Goto(arg("label")?)),
+
+        // stack commands
+        "push" | "pop" => {
+            let segment = parse_segment(arg("segment")?)?;
+            let arg2 = arg("index")?;
+            let index = arg2
+                .parse::<u16>()
+                .map_err(|_| format!("Invalid index {:?} in {:?} command", arg2, command))?;
+            Ok(match command {
+                "push" => Token::Push(segment, index),
+                _ => Token::Pop(segment, index),
+            })
+        }
+
+        // function calling commands
+        "return" => Ok(Token::Return),
+        "function" | "call" => {
+            let name = arg("function name")?;
+            let num = arg("arg2")?
+                .parse::<u16>()
+                .map_err(|_| "Invalid num".to_string())?;
+            Ok(match command {
+                "function" => Token::Function(name, num),
+                _ => Token::Call(name, num),
+            })
+        }
 
-            _ => Err(format!("Could not parse line {}", line)),
-        },
+        _ => Err(format!("Could not parse line {}", line)),
     }
 }
 
-pub fn parse_lines(lines: &str) -> Result<Vec<Token>, String> {
+pub fn parse_lines(lines: &str) -> Result<Vec<Token<'_>>, String> {
     let mut tokens: Vec<Token> = Vec::new();
     for line in lines.lines() {
         let token = parse_line(line)?;
@@ -130,6 +121,164 @@ pub fn parse_lines(lines: &str) -> Result<Vec<Token>, String> {
     return Ok(tokens);
 }
 
+/// A token with its name, if it has one, stored separately as a range of
+/// `StreamedTokens::names`.
+#[derive(Copy, Clone, Debug)]
+struct StoredToken {
+    token: Token<'static>,
+    name: (u32, u32),
+}
+
+/// Tokenizes vm code as it arrives in pieces, e.g. while reading a large
+/// generated file, so that the text never has to be held in memory at once.
+/// Only an incomplete last line is buffered between pieces, and each distinct
+/// name is copied once.
+pub struct TokenStream {
+    partial_line: String,
+    names: String,
+    name_ranges: HashMap<Box<str>, (u32, u32)>,
+    tokens: Vec<StoredToken>,
+}
+
+/// The tokens of a complete file, which no longer need its text.
+#[derive(Clone, Debug)]
+pub struct StreamedTokens {
+    names: String,
+    tokens: Vec<StoredToken>,
+}
+
+impl TokenStream {
+    pub fn new() -> TokenStream {
+        TokenStream {
+            partial_line: String::new(),
+            names: String::new(),
+            name_ranges: HashMap::new(),
+            tokens: Vec::new(),
+        }
+    }
+
+    /// Tokenizes the complete lines in `chunk`, keeping whatever follows the
+    /// last line break for the next chunk.
+    pub fn push(&mut self, chunk: &str) -> Result<(), String> {
+        let mut rest = chunk;
+        if !self.partial_line.is_empty() {
+            match rest.find('\n') {
+                Some(end) => {
+                    let mut line = std::mem::take(&mut self.partial_line);
+                    line.push_str(&rest[..end]);
+                    self.push_line(&line)?;
+                    rest = &rest[end + 1..];
+                }
+                None => {
+                    self.partial_line.push_str(rest);
+                    return Ok(());
+                }
+            }
+        }
+        while let Some(end) = rest.find('\n') {
+            self.push_line(&rest[..end])?;
+            rest = &rest[end + 1..];
+        }
+        self.partial_line.push_str(rest);
+        Ok(())
+    }
+
+    /// Tokenizes everything left in `reader`, a line at a time.
+    pub fn read<R: BufRead>(&mut self, mut reader: R) -> Result<(), String> {
+        let mut line = String::new();
+        loop {
+            line.clear();
+            let n = reader
+                .read_line(&mut line)
+                .map_err(|e| format!("Failed reading vm code: {}", e))?;
+            if n == 0 {
+                return Ok(());
+            }
+            self.push(&line)?;
+        }
+    }
+
+    /// Tokenizes the last line, if it didn't end with a line break.
+    pub fn finish(mut self) -> Result<StreamedTokens, String> {
+        let line = std::mem::take(&mut self.partial_line);
+        self.push_line(&line)?;
+        self.names.shrink_to_fit();
+        self.tokens.shrink_to_fit();
+        Ok(StreamedTokens {
+            names: self.names,
+            tokens: self.tokens,
+        })
+    }
+
+    fn push_line(&mut self, line: &str) -> Result<(), String> {
+        let line = line.strip_suffix('\r').unwrap_or(line);
+        let (token, name) = match parse_line(line)? {
+            Token::None => return Ok(()),
+            Token::Label(name) => (Token::Label(""), name),
+            Token::If(name) => (Token::If(""), name),
+            Token::Goto(name) => (Token::Goto(""), name),
+            Token::Function(name, n) => (Token::Function("", n), name),
+            Token::Call(name, n) => (Token::Call("", n), name),
+            Token::Neg => (Token::Neg, ""),
+            Token::Not => (Token::Not, ""),
+            Token::Add => (Token::Add, ""),
+            Token::Sub => (Token::Sub, ""),
+            Token::And => (Token::And, ""),
+            Token::Or => (Token::Or, ""),
+            Token::Eq => (Token::Eq, ""),
+            Token::Lt => (Token::Lt, ""),
+            Token::Gt => (Token::Gt, ""),
+            Token::Push(segment, index) => (Token::Push(segment, index), ""),
+            Token::Pop(segment, index) => (Token::Pop(segment, index), ""),
+            Token::Return => (Token::Return, ""),
+        };
+        let name = match self.name_ranges.get(name) {
+            Some(range) => *range,
+            None => {
+                let range = (
+                    self.names.len() as u32,
+                    (self.names.len() + name.len()) as u32,
+                );
+                self.names.push_str(name);
+                self.name_ranges.insert(name.into(), range);
+                range
+            }
+        };
+        self.tokens.push(StoredToken { token, name });
+        Ok(())
+    }
+}
+
+impl StreamedTokens {
+    pub fn from_str(lines: &str) -> Result<StreamedTokens, String> {
+        let mut stream = TokenStream::new();
+        stream.push(lines)?;
+        stream.finish()
+    }
+
+    pub fn len(&self) -> usize {
+        self.tokens.len()
+    }
+
+    /// The tokens, with names borrowed from this file.
+    pub fn tokens(&self) -> Vec<Token<'_>> {
+        self.tokens
+            .iter()
+            .map(|stored| {
+                let name = &self.names[stored.name.0 as usize..stored.name.1 as usize];
+                match stored.token {
+                    Token::Label(_) => Token::Label(name),
+                    Token::If(_) => Token::If(name),
+                    Token::Goto(_) => Token::Goto(name),
+                    Token::Function(_, n) => Token::Function(name, n),
+                    Token::Call(_, n) => Token::Call(name, n),
+                    token => token,
+                }
+            })
+            .collect()
+    }
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -143,7 +292,12 @@ mod tests {
         assert_eq!(
             parse_line("push foo 10"),
             Err("Invalid segment \"foo\"".to_string())
-        )
+        );
+        assert_eq!(parse_line("goto END//loop"), Ok(Token::Goto("END")));
+        assert_eq!(
+            parse_line("call Math.multiply"),
+            Err("Missing arg2 in \"call\" command".to_string())
+        );
     }
 
     #[test]
@@ -160,11 +314,36 @@ function foo 2
 return // the end"
             ),
             Ok(vec![
-                Token::Function("foo".to_string(), 2),
+                Token::Function("foo", 2),
                 Token::Push(Segment::Constant, 3),
                 Token::Not,
                 Token::Return,
             ])
         );
     }
+
+    #[test]
+    fn test_token_stream() {
+        let code = "function Main.main 1\r\n  push constant 3 // three\n  call Math.abs 1\nlabel END\ngoto END\ncall Math.abs 1";
+        let expected = parse_lines(code).unwrap();
+        for chunk_size in [1, 2, 7, code.len()] {
+            let mut stream = TokenStream::new();
+            for chunk in code.as_bytes().chunks(chunk_size) {
+                stream.push(std::str::from_utf8(chunk).unwrap()).unwrap();
+            }
+            let streamed = stream.finish().unwrap();
+            assert_eq!(streamed.tokens(), expected);
+            assert_eq!(streamed.names, "Main.mainMath.absEND");
+        }
+
+        let mut stream = TokenStream::new();
+        stream.read(code.as_bytes()).unwrap();
+        assert_eq!(stream.finish().unwrap().tokens(), expected);
+
+        let mut stream = TokenStream::new();
+        assert_eq!(
+            stream.push("push foo 1\n"),
+            Err("Invalid segment \"foo\"".to_string())
+        );
+    }
 }
@@ -0,0 +1,210 @@
+use super::vmcommand::{InCodeFuncRef, VMProgram};
+use std::collections::HashMap;
+use std::fmt::Write;
+
+const HEADER: &str = "hackvm profile 2";
+// profiles without code steps, which are read as if no code was inlined
+const HEADER_V1: &str = "hackvm profile 1";
+
+#[derive(Default, PartialEq, Copy, Clone, Debug)]
+pub struct FunctionProfile {
+    pub calls: u64,
+    /// Steps of the function, including the ones it ran inlined into its
+    /// callers.
+    pub steps: u64,
+    /// Steps that ran the function's own code, including the code inlined
+    /// into it. This is what decides where the code goes in the layout.
+    pub code_steps: u64,
+}
+
+/// Calls and steps per function from a profiled run. Functions are named
+/// rather than referenced, so a profile saved from one run still applies when
+/// the same files are linked again.
+#[derive(Default, PartialEq, Clone, Debug)]
+pub struct Profile {
+    pub functions: HashMap<String, FunctionProfile>,
+}
+
+impl Profile {
+    pub fn new() -> Profile {
+        Profile::default()
+    }
+
+    pub fn get(&self, name: &str) -> FunctionProfile {
+        self.functions.get(name).copied().unwrap_or_default()
+    }
+
+    /// Adds the counts from another run of the same program.
+    pub fn merge(&mut self, other: &Profile) {
+        for (name, counts) in other.functions.iter() {
+            let entry = self.functions.entry(name.clone()).or_default();
+            entry.calls += counts.calls;
+            entry.steps += counts.steps;
+            entry.code_steps += counts.code_steps;
+        }
+    }
+
+    /// Serializes the profile as one `name calls steps code_steps` line per
+    /// function, hottest first.
+    pub fn to_text(&self) -> String {
+        let mut functions: Vec<_> = self.functions.iter().collect();
+        functions.sort_by(|(a_name, a), (b_name, b)| {
+            b.steps.cmp(&a.steps).then_with(|| a_name.cmp(b_name))
+        });
+        let mut text = format!("{}\n", HEADER);
+        for (name, counts) in functions {
+            writeln!(
+                &mut text,
+                "{} {} {} {}",
+                name, counts.calls, counts.steps, counts.code_steps
+            )
+            .unwrap();
+        }
+        text
+    }
+
+    pub fn from_text(text: &str) -> Result<Profile, String> {
+        let mut lines = text.lines();
+        let v1 = match lines.next() {
+            Some(HEADER) => false,
+            Some(HEADER_V1) => true,
+            _ => return Err("not a hackvm profile".to_string()),
+        };
+        let mut profile = Profile::new();
+        for line in lines.filter(|line| !line.trim().is_empty()) {
+            let parts: Vec<&str> = line.split_ascii_whitespace().collect();
+            let count = |s: &str| {
+                s.parse::<u64>()
+                    .map_err(|_| format!("Invalid count {:?} in profile line {:?}", s, line))
+            };
+            match parts[..] {
+                [name, calls, steps] if v1 => {
+                    profile.functions.insert(
+                        name.to_string(),
+                        FunctionProfile {
+                            calls: count(calls)?,
+                            steps: count(steps)?,
+                            code_steps: count(steps)?,
+                        },
+                    );
+                }
+                [name, calls, steps, code_steps] if !v1 => {
+                    profile.functions.insert(
+                        name.to_string(),
+                        FunctionProfile {
+                            calls: count(calls)?,
+                            steps: count(steps)?,
+                            code_steps: count(code_steps)?,
+                        },
+                    );
+                }
+                _ => return Err(format!("Could not parse profile line {:?}", line)),
+            }
+        }
+        Ok(profile)
+    }
+
+    /// Orders the program's functions for layout: functions whose code ran,
+    /// hottest first, followed by the ones that never ran in their original
+    /// order. Rarely taken paths, like the callers of `Sys.error`, end up at
+    /// the end instead of between the hot functions. Leaf functions that only
+    /// ran inlined into their callers count as cold, since their own copy of
+    /// the code didn't run.
+    pub fn layout_order(&self, program: &VMProgram) -> Vec<InCodeFuncRef> {
+        let mut order: Vec<(InCodeFuncRef, u64)> = Vec::new();
+        for (file_index, file) in program.files.iter().enumerate() {
+            for (function_index, function) in file.functions.iter().enumerate() {
+                order.push((
+                    InCodeFuncRef::new(file_index, function_index),
+                    self.get(&function.name).code_steps,
+                ));
+            }
+        }
+        // stable, so ties keep the original order
+        order.sort_by(|(_, a), (_, b)| b.cmp(a));
+        order.into_iter().map(|(func_ref, _)| func_ref).collect()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_text_round_trip() {
+        let mut profile = Profile::new();
+        profile.functions.insert(
+            "Main.main".to_string(),
+            FunctionProfile {
+                calls: 1,
+                steps: 20,
+                code_steps: 25,
+            },
+        );
+        profile.functions.insert(
+            "Math.abs".to_string(),
+            FunctionProfile {
+                calls: 5,
+                steps: 30,
+                code_steps: 0,
+            },
+        );
+        let text = profile.to_text();
+        assert_eq!(
+            text,
+            "hackvm profile 2\nMath.abs 5 30 0\nMain.main 1 20 25\n"
+        );
+        assert_eq!(Profile::from_text(&text), Ok(profile.clone()));
+
+        profile.merge(&Profile::from_text(&text).unwrap());
+        assert_eq!(
+            profile.get("Math.abs"),
+            FunctionProfile {
+                calls: 10,
+                steps: 60,
+                code_steps: 0,
+            }
+        );
+        assert_eq!(profile.get("Sys.init"), FunctionProfile::default());
+
+        assert!(Profile::from_text("Main.main 1 20").is_err());
+        assert!(Profile::from_text("hackvm profile 2\nMain.main 1 2").is_err());
+        assert!(Profile::from_text("hackvm profile 2\nMain.main x 2 2").is_err());
+
+        // older profiles count steps against the code they ran in
+        let v1 = Profile::from_text("hackvm profile 1\nMain.main 1 20").unwrap();
+        assert_eq!(v1.get("Main.main").code_steps, 20);
+        assert!(Profile::from_text("hackvm profile 1\nMain.main 1").is_err());
+    }
+
+    #[test]
+    fn test_layout_order() {
+        let program = VMProgram::new(&vec![(
+            "Sys.vm",
+            "
+            function Sys.init 0
+            return
+            function Sys.error 0
+            return
+            function Sys.hot 0
+            return
+            function Sys.warm 0
+            return",
+        )])
+        .unwrap();
+        // Sys.error ran often, but only inlined into its callers
+        let profile = Profile::from_text(
+            "hackvm profile 2\nSys.warm 1 5 5\nSys.hot 1 50 50\nSys.error 9 90 0\n",
+        )
+        .unwrap();
+        assert_eq!(
+            profile.layout_order(&program),
+            vec![
+                InCodeFuncRef::new(0, 2),
+                InCodeFuncRef::new(0, 3),
+                InCodeFuncRef::new(0, 0),
+                InCodeFuncRef::new(0, 1),
+            ]
+        );
+    }
+}
@@ -0,0 +1,178 @@
+// Batches below this aren't worth the call overhead, and batches above this
+// would run for too long if the throughput estimate is off.
+const MIN_BATCH: f64 = 100.0;
+const MAX_BATCH: f64 = 10_000_000.0;
+// How far behind its target speed a slow or paused machine can fall before
+// the missed steps are dropped instead of being caught up in a burst.
+const MAX_CATCH_UP_MS: f64 = 100.0;
+const STATS_WINDOW_MS: f64 = 500.0;
+
+/// Measurements of the last complete stats window.
+#[derive(Default, PartialEq, Copy, Clone, Debug)]
+pub struct SchedulerStats {
+    pub steps_per_second: f64,
+    pub average_slice_ms: f64,
+    pub max_slice_ms: f64,
+}
+
+#[derive(Default)]
+struct StatsWindow {
+    start: Option<f64>,
+    steps: u64,
+    slices: u32,
+    slice_ms: f64,
+    max_slice_ms: f64,
+}
+
+/// Decides how many steps to run in each time slice. It measures how fast
+/// the steps of each slice ran, and sizes the next batch to fill the slice's
+/// time budget, optionally capped by a target speed. Times are in
+/// milliseconds from any fixed origin, like `performance.now()`.
+pub struct Scheduler {
+    target_speed: Option<f64>,
+    steps_per_ms: f64,
+    // steps the target speed allows that haven't been run yet
+    owed: f64,
+    slice_start: Option<f64>,
+    batch: usize,
+    window: StatsWindow,
+    stats: SchedulerStats,
+}
+
+impl Scheduler {
+    pub fn new() -> Scheduler {
+        Scheduler {
+            target_speed: None,
+            // a conservative guess, corrected after the first slice
+            steps_per_ms: 1000.0,
+            owed: 0.0,
+            slice_start: None,
+            batch: 0,
+            window: StatsWindow::default(),
+            stats: SchedulerStats::default(),
+        }
+    }
+
+    /// Limits the speed to `steps_per_second`, or removes the limit if it's
+    /// `None`.
+    pub fn set_target_speed(&mut self, steps_per_second: Option<f64>) {
+        self.target_speed = steps_per_second;
+        self.owed = 0.0;
+    }
+
+    /// Starts a slice at `now` and returns how many steps to run in it.
+    pub fn start_slice(&mut self, now: f64, budget_ms: f64) -> usize {
+        let capacity = (self.steps_per_ms * budget_ms)
+            .max(MIN_BATCH)
+            .min(MAX_BATCH);
+        let batch = match self.target_speed {
+            None => capacity,
+            Some(speed) => {
+                let elapsed = self.slice_start.map_or(0.0, |start| now - start);
+                let allowed = speed * elapsed.max(0.0).min(MAX_CATCH_UP_MS) / 1000.0;
+                self.owed = (self.owed + allowed).min(speed * MAX_CATCH_UP_MS / 1000.0);
+                capacity.min(self.owed)
+            }
+        };
+        self.slice_start = Some(now);
+        self.batch = batch as usize;
+        self.batch
+    }
+
+    /// Ends the slice started last, once its steps have run.
+    pub fn end_slice(&mut self, now: f64) {
+        let start = match self.slice_start {
+            Some(start) => start,
+            None => return,
+        };
+        let elapsed = now - start;
+        let batch = self.batch as f64;
+        // timers can be too coarse to measure a short slice at all
+        if batch > 0.0 && elapsed > 0.0 {
+            let measured = batch / elapsed;
+            // back off at once when the steps got slower, so that the next
+            // slice doesn't overrun its budget too, but speed up gradually
+            self.steps_per_ms = if measured < self.steps_per_ms {
+                measured
+            } else {
+                self.steps_per_ms * 0.75 + measured * 0.25
+            };
+        }
+        self.owed = (self.owed - batch).max(0.0);
+
+        let window = &mut self.window;
+        let window_start = *window.start.get_or_insert(start);
+        window.steps += self.batch as u64;
+        window.slices += 1;
+        window.slice_ms += elapsed;
+        window.max_slice_ms = window.max_slice_ms.max(elapsed);
+        if now - window_start >= STATS_WINDOW_MS {
+            self.stats = SchedulerStats {
+                steps_per_second: window.steps as f64 * 1000.0 / (now - window_start),
+                average_slice_ms: window.slice_ms / window.slices as f64,
+                max_slice_ms: window.max_slice_ms,
+            };
+            self.window = StatsWindow {
+                start: Some(now),
+                ..StatsWindow::default()
+            };
+        }
+    }
+
+    pub fn stats(&self) -> SchedulerStats {
+        self.stats
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // runs slices back to back on a machine doing `steps_per_ms`
+    fn run(scheduler: &mut Scheduler, now: &mut f64, steps_per_ms: f64, slices: usize) -> usize {
+        let mut batch = 0;
+        for _ in 0..slices {
+            batch = scheduler.start_slice(*now, 8.0);
+            *now += batch as f64 / steps_per_ms;
+            scheduler.end_slice(*now);
+        }
+        batch
+    }
+
+    #[test]
+    fn test_fills_budget() {
+        let mut scheduler = Scheduler::new();
+        let mut now = 0.0;
+        let batch = run(&mut scheduler, &mut now, 5000.0, 200);
+        assert!(batch > 39_000 && batch <= 40_000, "batch {}", batch);
+
+        // the machine got slower, the next slice is sized for that
+        run(&mut scheduler, &mut now, 500.0, 1);
+        let batch = scheduler.start_slice(now, 8.0);
+        assert!(batch > 3990 && batch <= 4000, "batch {}", batch);
+
+        let stats = scheduler.stats();
+        assert!(stats.steps_per_second > 4_000_000.0);
+        assert!(stats.average_slice_ms <= 8.0);
+    }
+
+    #[test]
+    fn test_target_speed() {
+        let mut scheduler = Scheduler::new();
+        scheduler.set_target_speed(Some(1_000_000.0));
+        let mut now = 0.0;
+        let mut steps = 0;
+        for _ in 0..100 {
+            steps += scheduler.start_slice(now, 8.0);
+            now += 2.0;
+            scheduler.end_slice(now);
+            now += 8.0;
+        }
+        // 1000 steps per ms over 1 second, less the first slice
+        assert!(steps > 980_000 && steps <= 1_000_000, "steps {}", steps);
+
+        // a long pause isn't caught up all at once
+        now += 10_000.0;
+        assert!(scheduler.start_slice(now, 1000.0) <= 100_000);
+    }
+}
@@ -0,0 +1,286 @@
+pub const SCREEN_START: usize = 16384;
+pub const SCREEN_WORDS: usize = 8192;
+pub const SCREEN_WIDTH: usize = 512;
+pub const SCREEN_HEIGHT: usize = 256;
+pub const WORDS_PER_ROW: usize = SCREEN_WIDTH / 16;
+
+const WHITE: [u8; 4] = [0xff, 0xff, 0xff, 0xff];
+const BLACK: [u8; 4] = [0x00, 0x00, 0x00, 0xff];
+
+/// The screen words written since the screen was last drawn, one bit each.
+#[derive(Clone)]
+pub struct ScreenChanges {
+    dirty: [u64; SCREEN_WORDS / 64],
+    any: bool,
+}
+
+impl ScreenChanges {
+    /// Starts with every word dirty, so that the first frame is drawn in full.
+    pub fn new() -> ScreenChanges {
+        ScreenChanges {
+            dirty: [u64::MAX; SCREEN_WORDS / 64],
+            any: true,
+        }
+    }
+
+    pub fn none() -> ScreenChanges {
+        ScreenChanges {
+            dirty: [0; SCREEN_WORDS / 64],
+            any: false,
+        }
+    }
+
+    /// Marks the word at a ram address as dirty, if it's on the screen.
+    #[inline(always)]
+    pub fn mark(&mut self, address: usize) {
+        let offset = address.wrapping_sub(SCREEN_START);
+        if offset < SCREEN_WORDS {
+            self.dirty[offset / 64] |= 1 << (offset % 64);
+            self.any = true;
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        !self.any
+    }
+
+    /// Returns the changes so far, and starts tracking from scratch.
+    pub fn take(&mut self) -> ScreenChanges {
+        std::mem::replace(self, ScreenChanges::none())
+    }
+
+    /// The offsets of the dirty words from the start of the screen.
+    pub fn iter(&self) -> impl Iterator<Item = usize> + '_ {
+        self.dirty
+            .iter()
+            .enumerate()
+            .filter(|(_, bits)| **bits != 0)
+            .flat_map(|(i, bits)| {
+                (0..64)
+                    .filter(move |bit| bits & (1 << bit) != 0)
+                    .map(move |bit| i * 64 + bit)
+            })
+    }
+}
+
+/// A rectangle of screen pixels.
+#[derive(PartialEq, Copy, Clone, Debug)]
+pub struct Rect {
+    pub x: usize,
+    pub y: usize,
+    pub width: usize,
+    pub height: usize,
+}
+
+impl Rect {
+    pub fn empty() -> Rect {
+        Rect {
+            x: 0,
+            y: 0,
+            width: 0,
+            height: 0,
+        }
+    }
+}
+
+/// The RGBA colours of pixels whose screen bit is clear and set.
+#[derive(PartialEq, Copy, Clone, Debug)]
+pub struct Palette {
+    pub background: [u8; 4],
+    pub foreground: [u8; 4],
+}
+
+impl Default for Palette {
+    fn default() -> Palette {
+        Palette {
+            background: WHITE,
+            foreground: BLACK,
+        }
+    }
+}
+
+/// Writes the 16 pixels of a screen word, least significant bit first, as
+/// RGBA into `out`. This is the reference for `PixelTable`.
+#[cfg(test)]
+fn expand_word(word: i32, palette: &Palette, out: &mut [u8]) {
+    for (i, pixel) in out.chunks_exact_mut(4).enumerate() {
+        pixel.copy_from_slice(if word & 1 << i != 0 {
+            &palette.foreground
+        } else {
+            &palette.background
+        });
+    }
+}
+
+/// The RGBA pixels of every byte of a screen word, so that a word expands
+/// with two copies instead of a test and a copy per pixel.
+struct PixelTable {
+    bytes: Vec<[u8; 32]>,
+}
+
+impl PixelTable {
+    fn new(palette: &Palette) -> PixelTable {
+        let bytes = (0..256)
+            .map(|byte| {
+                let mut pixels = [0; 32];
+                for (i, pixel) in pixels.chunks_exact_mut(4).enumerate() {
+                    pixel.copy_from_slice(if byte & 1 << i != 0 {
+                        &palette.foreground
+                    } else {
+                        &palette.background
+                    });
+                }
+                pixels
+            })
+            .collect();
+        PixelTable { bytes }
+    }
+
+    #[inline(always)]
+    fn expand_word(&self, word: i32, out: &mut [u8]) {
+        out[..32].copy_from_slice(&self.bytes[(word & 0xff) as usize]);
+        out[32..64].copy_from_slice(&self.bytes[(word >> 8 & 0xff) as usize]);
+    }
+}
+
+/// RGBA pixels of the screen, kept between frames so that only the words
+/// that changed need to be expanded again.
+pub struct Framebuffer {
+    pixels: Vec<u8>,
+    palette: Palette,
+    table: PixelTable,
+}
+
+impl Framebuffer {
+    pub fn new() -> Framebuffer {
+        Framebuffer::with_palette(Palette::default())
+    }
+
+    pub fn with_palette(palette: Palette) -> Framebuffer {
+        Framebuffer {
+            pixels: palette.background.repeat(SCREEN_WIDTH * SCREEN_HEIGHT),
+            palette,
+            table: PixelTable::new(&palette),
+        }
+    }
+
+    pub fn palette(&self) -> Palette {
+        self.palette
+    }
+
+    /// Changes the colours used from now on. The pixels already expanded
+    /// keep their colours until their words are updated again.
+    pub fn set_palette(&mut self, palette: Palette) {
+        self.palette = palette;
+        self.table = PixelTable::new(&palette);
+    }
+
+    pub fn pixels(&self) -> &[u8] {
+        &self.pixels
+    }
+
+    pub fn pixels_mut(&mut self) -> &mut [u8] {
+        &mut self.pixels
+    }
+
+    /// Expands the changed words of `screen` into pixels, returning the
+    /// smallest rectangle containing every change, if there were any.
+    pub fn update(&mut self, screen: &[i32], changes: &ScreenChanges) -> Option<Rect> {
+        if changes.is_empty() {
+            return None;
+        }
+        let (mut min_x, mut min_y) = (WORDS_PER_ROW, SCREEN_HEIGHT);
+        let (mut max_x, mut max_y) = (0, 0);
+        for offset in changes.iter() {
+            let (x, y) = (offset % WORDS_PER_ROW, offset / WORDS_PER_ROW);
+            min_x = min_x.min(x);
+            max_x = max_x.max(x);
+            min_y = min_y.min(y);
+            max_y = max_y.max(y);
+            self.table.expand_word(
+                screen[offset],
+                &mut self.pixels[offset * 64..(offset + 1) * 64],
+            );
+        }
+        Some(Rect {
+            x: min_x * 16,
+            y: min_y,
+            width: (max_x - min_x + 1) * 16,
+            height: max_y - min_y + 1,
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_screen_changes() {
+        let mut changes = ScreenChanges::none();
+        assert!(changes.is_empty());
+        changes.mark(SCREEN_START - 1);
+        changes.mark(SCREEN_START + SCREEN_WORDS);
+        assert!(changes.is_empty());
+        changes.mark(SCREEN_START + 100);
+        changes.mark(SCREEN_START + 3);
+        changes.mark(SCREEN_START + 100);
+        assert_eq!(changes.take().iter().collect::<Vec<_>>(), vec![3, 100]);
+        assert!(changes.is_empty());
+        assert_eq!(ScreenChanges::new().iter().count(), SCREEN_WORDS);
+    }
+
+    #[test]
+    fn test_framebuffer_update() {
+        let mut screen = vec![0; SCREEN_WORDS];
+        let mut framebuffer = Framebuffer::new();
+        assert_eq!(framebuffer.update(&screen, &ScreenChanges::none()), None);
+
+        screen[WORDS_PER_ROW * 2 + 1] = 0b101;
+        screen[WORDS_PER_ROW * 5 + 3] = -1;
+        let mut changes = ScreenChanges::none();
+        changes.mark(SCREEN_START + WORDS_PER_ROW * 2 + 1);
+        changes.mark(SCREEN_START + WORDS_PER_ROW * 5 + 3);
+        assert_eq!(
+            framebuffer.update(&screen, &changes),
+            Some(Rect {
+                x: 16,
+                y: 2,
+                width: 48,
+                height: 4
+            })
+        );
+        let pixel = |x: usize, y: usize| {
+            let i = (y * SCREEN_WIDTH + x) * 4;
+            &framebuffer.pixels()[i..i + 4]
+        };
+        assert_eq!(pixel(16, 2), &BLACK);
+        assert_eq!(pixel(17, 2), &WHITE);
+        assert_eq!(pixel(18, 2), &BLACK);
+        assert_eq!(pixel(63, 5), &BLACK);
+        assert_eq!(pixel(64, 5), &WHITE);
+    }
+
+    #[test]
+    fn test_pixel_table_matches_scalar() {
+        let palette = Palette {
+            background: [0x10, 0x20, 0x30, 0xff],
+            foreground: [0xf0, 0xe0, 0xd0, 0x80],
+        };
+        let table = PixelTable::new(&palette);
+        let (mut expected, mut actual) = ([0; 64], [0; 64]);
+        for word in (i16::MIN..=i16::MAX).step_by(7).chain(vec![-1, 0]) {
+            expand_word(word as i32, &palette, &mut expected);
+            table.expand_word(word as i32, &mut actual);
+            assert_eq!(&actual[..], &expected[..], "word {:#06x}", word);
+        }
+
+        let mut framebuffer = Framebuffer::with_palette(palette);
+        let screen = vec![0b10; SCREEN_WORDS];
+        framebuffer.update(&screen, &ScreenChanges::new());
+        assert_eq!(
+            &framebuffer.pixels()[..8],
+            &[0x10, 0x20, 0x30, 0xff, 0xf0, 0xe0, 0xd0, 0x80]
+        );
+    }
+}
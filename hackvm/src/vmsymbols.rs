@@ -0,0 +1,209 @@
+use super::vmcommand::{FunctionRef, InCodeFuncRef};
+use std::collections::HashMap;
+use std::sync::Arc;
+
+/// An interned name. Symbols are handed out densely from 0, so they can be
+/// used to index into tables.
+#[derive(Eq, Hash, PartialEq, PartialOrd, Ord, Copy, Clone, Debug)]
+pub struct Symbol(u32);
+
+impl Symbol {
+    pub fn index(self) -> usize {
+        self.0 as usize
+    }
+}
+
+/// Maps each distinct name to a `Symbol`, storing every name only once. The
+/// map and the list of names share each name's allocation.
+#[derive(Clone, Default)]
+pub struct Interner {
+    symbols: HashMap<Arc<str>, Symbol>,
+    names: Vec<Arc<str>>,
+}
+
+impl Interner {
+    pub fn new() -> Interner {
+        Interner::default()
+    }
+
+    pub fn intern(&mut self, name: &str) -> Symbol {
+        if let Some(symbol) = self.symbols.get(name) {
+            return *symbol;
+        }
+        let symbol = Symbol(self.names.len() as u32);
+        let name: Arc<str> = name.into();
+        self.names.push(name.clone());
+        self.symbols.insert(name, symbol);
+        symbol
+    }
+
+    /// Looks up the symbol for a name without interning it.
+    pub fn get(&self, name: &str) -> Option<Symbol> {
+        self.symbols.get(name).copied()
+    }
+
+    pub fn resolve(&self, symbol: Symbol) -> &str {
+        &self.names[symbol.index()]
+    }
+
+    pub fn len(&self) -> usize {
+        self.names.len()
+    }
+}
+
+/// The program's function and label names, along with the function each
+/// function name refers to. Functions are stored densely by symbol, and
+/// names are stored densely by function, so lookups in either direction
+/// don't need to hash anything once a name is interned.
+#[derive(Clone, Default)]
+pub struct FunctionTable {
+    pub symbols: Interner,
+    functions: Vec<Option<FunctionRef>>,
+    internal_names: Vec<Option<Symbol>>,
+    in_code_names: Vec<Vec<Option<Symbol>>>,
+}
+
+impl FunctionTable {
+    pub fn new() -> FunctionTable {
+        FunctionTable::default()
+    }
+
+    pub fn insert(&mut self, name: &str, func_ref: FunctionRef) -> Symbol {
+        let symbol = self.symbols.intern(name);
+        self.insert_symbol(symbol, func_ref);
+        symbol
+    }
+
+    fn insert_symbol(&mut self, symbol: Symbol, func_ref: FunctionRef) {
+        if self.functions.len() <= symbol.index() {
+            self.functions.resize(symbol.index() + 1, None);
+        }
+        self.functions[symbol.index()] = Some(func_ref);
+        let names = match func_ref {
+            FunctionRef::Internal(index) => {
+                if self.internal_names.len() <= index {
+                    self.internal_names.resize(index + 1, None);
+                }
+                &mut self.internal_names[index]
+            }
+            FunctionRef::InCode(in_code_ref) => {
+                let (file_index, function_index) =
+                    (in_code_ref.file_index(), in_code_ref.function_index());
+                if self.in_code_names.len() <= file_index {
+                    self.in_code_names.resize(file_index + 1, Vec::new());
+                }
+                let file_names = &mut self.in_code_names[file_index];
+                if file_names.len() <= function_index {
+                    file_names.resize(function_index + 1, None);
+                }
+                &mut file_names[function_index]
+            }
+        };
+        *names = Some(symbol);
+    }
+
+    /// Moves in-code functions to wherever `remap` says they are now, and
+    /// forgets the ones it returns `None` for. Names stay interned, so
+    /// symbols handed out before remain valid.
+    pub fn remap_in_code<F>(&mut self, remap: F)
+    where
+        F: Fn(InCodeFuncRef) -> Option<InCodeFuncRef>,
+    {
+        let functions = std::mem::take(&mut self.functions);
+        self.internal_names.clear();
+        self.in_code_names.clear();
+        for (index, func_ref) in functions.into_iter().enumerate() {
+            let func_ref = match func_ref {
+                Some(FunctionRef::InCode(in_code_ref)) => {
+                    remap(in_code_ref).map(FunctionRef::InCode)
+                }
+                other => other,
+            };
+            if let Some(func_ref) = func_ref {
+                self.insert_symbol(Symbol(index as u32), func_ref);
+            }
+        }
+    }
+
+    pub fn get_by_symbol(&self, symbol: Symbol) -> Option<FunctionRef> {
+        self.functions.get(symbol.index()).copied().flatten()
+    }
+
+    pub fn get(&self, name: &str) -> Option<FunctionRef> {
+        self.symbols
+            .get(name)
+            .and_then(|symbol| self.get_by_symbol(symbol))
+    }
+
+    /// Iterates over every function name and what it refers to, in the order
+    /// the names were interned.
+    pub fn iter(&self) -> impl Iterator<Item = (&str, FunctionRef)> {
+        self.functions
+            .iter()
+            .enumerate()
+            .filter_map(move |(index, func_ref)| {
+                func_ref.map(|func_ref| (&*self.symbols.names[index], func_ref))
+            })
+    }
+
+    pub fn get_name(&self, func_ref: &FunctionRef) -> Option<&str> {
+        let symbol = match func_ref {
+            FunctionRef::Internal(index) => self.internal_names.get(*index),
+            FunctionRef::InCode(in_code_ref) => self
+                .in_code_names
+                .get(in_code_ref.file_index())
+                .and_then(|names| names.get(in_code_ref.function_index())),
+        };
+        symbol
+            .copied()
+            .flatten()
+            .map(|symbol| self.symbols.resolve(symbol))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_interner() {
+        let mut interner = Interner::new();
+        let a = interner.intern("Main.main");
+        let b = interner.intern("LOOP");
+        assert_eq!(interner.intern("Main.main"), a);
+        assert_eq!(interner.get("LOOP"), Some(b));
+        assert_eq!(interner.get("END"), None);
+        assert_eq!(interner.resolve(b), "LOOP");
+        assert_eq!((a.index(), b.index(), interner.len()), (0, 1, 2));
+    }
+
+    #[test]
+    fn test_function_table() {
+        let mut table = FunctionTable::new();
+        table.symbols.intern("LOOP");
+        table.insert("Math.multiply", FunctionRef::Internal(1));
+        let main = table.insert("Main.main", FunctionRef::new(2, 3));
+        assert_eq!(table.get("Main.main"), Some(FunctionRef::new(2, 3)));
+        assert_eq!(table.get_by_symbol(main), Some(FunctionRef::new(2, 3)));
+        assert_eq!(table.get("LOOP"), None);
+        assert_eq!(table.get("Main.other"), None);
+        assert_eq!(
+            table.get_name(&FunctionRef::Internal(1)),
+            Some("Math.multiply")
+        );
+        assert_eq!(table.get_name(&FunctionRef::new(2, 3)), Some("Main.main"));
+        assert_eq!(table.get_name(&FunctionRef::new(2, 2)), None);
+        assert_eq!(table.get_name(&FunctionRef::Internal(0)), None);
+
+        table.insert("Main.other", FunctionRef::new(2, 5));
+        table.remap_in_code(|func_ref| match func_ref.function_index() {
+            3 => None,
+            index => Some(InCodeFuncRef::new(0, index)),
+        });
+        assert_eq!(table.get("Main.main"), None);
+        assert_eq!(table.get_name(&FunctionRef::new(2, 3)), None);
+        assert_eq!(table.get("Main.other"), Some(FunctionRef::new(0, 5)));
+        assert_eq!(table.get_name(&FunctionRef::new(0, 5)), Some("Main.other"));
+        assert_eq!(table.get("Math.multiply"), Some(FunctionRef::Internal(1)));
+    }
+}
@@ -0,0 +1,486 @@
+use super::vmcommand::{Command, FunctionRef, InCodeFuncRef, Operation, Segment, VMProgram};
+use super::vmprofile::Profile;
+use super::vmverifier::verify_stack_depths;
+
+pub const SP: usize = 0;
+pub const LCL: usize = 1;
+pub const ARG: usize = 2;
+pub const THIS: usize = 3;
+pub const THAT: usize = 4;
+
+/// Operations of the pre-decoded instruction set. Each `Command` is specialised
+/// by segment at link time so that executing it needs no further matching.
+///
+/// The discriminant of each opcode is its index into the emulator's handler table.
+#[derive(PartialEq, Eq, Copy, Clone, Debug)]
+pub enum Opcode {
+    // a = value
+    PushConstant,
+    // a = index into the segment
+    PushLocal,
+    PushArgument,
+    PushThis,
+    PushThat,
+    // a = absolute ram address
+    PushStatic,
+    PushTemp,
+    PushPointer,
+
+    // a = index into the segment
+    PopLocal,
+    PopArgument,
+    PopThis,
+    PopThat,
+    // a = absolute ram address
+    PopStatic,
+    PopTemp,
+    PopPointer,
+
+    // a = source, b = destination. Constants are plain values, "ram" operands
+    // are absolute addresses, and "segment" operands are encoded with
+    // `Instruction::segment_operand`.
+    CopyConstantToRam,
+    CopyConstantToSegment,
+    CopyRamToRam,
+    CopyRamToSegment,
+    CopySegmentToRam,
+    CopySegmentToSegment,
+
+    Neg,
+    Not,
+    Add,
+    Sub,
+    And,
+    Or,
+    Eq,
+    Lt,
+    Gt,
+
+    // a = function relative command index
+    Goto,
+    If,
+
+    // a = number of locals
+    Function,
+    // a = threaded function id, b = number of arguments
+    Call,
+    TailCall,
+    // a = internal function index, b = number of arguments
+    CallInternal,
+    Return,
+
+    // a command that can't be executed, e.g. `pop constant 0`.
+    // a = index into ThreadedCode::traps
+    Trap,
+}
+
+pub const NUM_OPCODES: usize = Opcode::Trap as usize + 1;
+
+#[derive(PartialEq, Copy, Clone, Debug)]
+pub struct Instruction {
+    pub opcode: Opcode,
+    pub a: u32,
+    pub b: u32,
+}
+
+impl Instruction {
+    fn new(opcode: Opcode, a: u32, b: u32) -> Instruction {
+        Instruction { opcode, a, b }
+    }
+
+    /// Packs a register relative operand: the address is `ram[register] + index`.
+    pub fn segment_operand(register: usize, index: u16) -> u32 {
+        (register as u32) << 16 | index as u32
+    }
+
+    /// Unpacks an operand created with `segment_operand` into (register, index).
+    #[inline(always)]
+    pub fn unpack_segment_operand(operand: u32) -> (usize, usize) {
+        ((operand >> 16) as usize, (operand & 0xffff) as usize)
+    }
+}
+
+/// Where a segment's values live once the current function is known.
+enum Location {
+    Constant,
+    /// At a fixed ram address.
+    Ram(usize),
+    /// Relative to the address stored in the given register.
+    Segment(usize),
+}
+
+fn locate(segment: Segment, index: u16, static_base: usize) -> Location {
+    let index = index as usize;
+    match segment {
+        Segment::Constant => Location::Constant,
+        Segment::Static => Location::Ram(static_base + index),
+        Segment::Temp => Location::Ram(5 + index),
+        Segment::Pointer => Location::Ram(THIS + index),
+        Segment::Local => Location::Segment(LCL),
+        Segment::Argument => Location::Segment(ARG),
+        Segment::This => Location::Segment(THIS),
+        Segment::That => Location::Segment(THAT),
+    }
+}
+
+#[derive(Copy, Clone, Debug)]
+pub struct ThreadedFunction {
+    pub function: InCodeFuncRef,
+    pub start: usize,
+    /// Whether the function passed stack depth verification, so that it can
+    /// run without stack checks.
+    pub verified: bool,
+    /// The most words the function needs on the stack, if verified.
+    pub max_stack_depth: usize,
+}
+
+/// A linked program decoded into one flat array of instructions.
+pub struct ThreadedCode {
+    pub instructions: Vec<Instruction>,
+    pub functions: Vec<ThreadedFunction>,
+    /// Error messages for `Opcode::Trap` instructions.
+    pub traps: Vec<String>,
+    /// Function stack depth before each instruction of a verified function.
+    pub depths: Vec<u16>,
+    /// Functions that failed verification and why.
+    pub warnings: Vec<String>,
+    /// Threaded function id for each function, indexed by file then function.
+    ids: Vec<Vec<usize>>,
+}
+
+impl ThreadedCode {
+    pub fn empty() -> ThreadedCode {
+        ThreadedCode {
+            instructions: Vec::new(),
+            functions: Vec::new(),
+            traps: Vec::new(),
+            depths: Vec::new(),
+            warnings: Vec::new(),
+            ids: Vec::new(),
+        }
+    }
+
+    pub fn function_id(&self, func_ref: &InCodeFuncRef) -> Option<usize> {
+        self.ids
+            .get(func_ref.file_index())
+            .and_then(|ids| ids.get(func_ref.function_index()))
+            .copied()
+    }
+
+    pub fn function(&self, func_ref: &InCodeFuncRef) -> Option<&ThreadedFunction> {
+        self.function_id(func_ref).map(|id| &self.functions[id])
+    }
+
+    pub fn function_start(&self, func_ref: &InCodeFuncRef) -> usize {
+        self.function(func_ref)
+            .map(|function| function.start)
+            .unwrap_or(usize::MAX)
+    }
+
+    pub fn from_program(program: &VMProgram) -> ThreadedCode {
+        let order: Vec<InCodeFuncRef> = program
+            .files
+            .iter()
+            .enumerate()
+            .flat_map(|(file_index, file)| {
+                (0..file.functions.len())
+                    .map(move |function_index| InCodeFuncRef::new(file_index, function_index))
+            })
+            .collect();
+        ThreadedCode::with_layout(program, &order)
+    }
+
+    /// Decodes the program with its functions laid out in the given order,
+    /// which must list every function exactly once. Functions are called by
+    /// id, so the layout only changes where their instructions live.
+    pub fn with_layout(program: &VMProgram, order: &[InCodeFuncRef]) -> ThreadedCode {
+        let mut code = ThreadedCode::empty();
+        for (file_index, file) in program.files.iter().enumerate() {
+            let mut ids = Vec::new();
+            for function_index in 0..file.functions.len() {
+                ids.push(code.functions.len());
+                code.functions.push(ThreadedFunction {
+                    function: InCodeFuncRef::new(file_index, function_index),
+                    start: 0,
+                    verified: false,
+                    max_stack_depth: 0,
+                });
+            }
+            code.ids.push(ids);
+        }
+
+        for func_ref in order {
+            let id = code
+                .function_id(func_ref)
+                .expect("layout lists a missing function");
+            let static_base = 16 + program.get_file(func_ref).static_offset;
+            let function = program.get_vmfunction(func_ref);
+            code.functions[id].start = code.instructions.len();
+            for command in function.commands.iter() {
+                let instruction = code.decode(program, command, static_base);
+                code.instructions.push(instruction);
+            }
+            match verify_stack_depths(&function.commands) {
+                Ok(stack) => {
+                    code.functions[id].verified = true;
+                    code.functions[id].max_stack_depth = stack.max_depth;
+                    code.depths
+                        .extend(stack.depths.iter().map(|depth| depth.unwrap_or(0)));
+                }
+                Err(e) => {
+                    code.warnings.push(format!("{}: {}", function.name, e));
+                    code.depths.resize(code.instructions.len(), 0);
+                }
+            }
+        }
+        code
+    }
+
+    fn trap(&mut self, message: String) -> Instruction {
+        self.traps.push(message);
+        Instruction::new(Opcode::Trap, (self.traps.len() - 1) as u32, 0)
+    }
+
+    fn decode(
+        &mut self,
+        program: &VMProgram,
+        command: &Command,
+        static_base: usize,
+    ) -> Instruction {
+        use Opcode::*;
+        match *command {
+            Command::Push(segment, index) => {
+                let opcode = match segment {
+                    Segment::Constant => PushConstant,
+                    Segment::Local => PushLocal,
+                    Segment::Argument => PushArgument,
+                    Segment::This => PushThis,
+                    Segment::That => PushThat,
+                    Segment::Static => PushStatic,
+                    Segment::Temp => PushTemp,
+                    Segment::Pointer => PushPointer,
+                };
+                match locate(segment, index, static_base) {
+                    Location::Ram(address) => Instruction::new(opcode, address as u32, 0),
+                    _ => Instruction::new(opcode, index as u32, 0),
+                }
+            }
+            Command::Pop(segment, index) => {
+                let opcode = match segment {
+                    Segment::Constant => {
+                        return self.trap(format!("can't pop into constant {}", index))
+                    }
+                    Segment::Local => PopLocal,
+                    Segment::Argument => PopArgument,
+                    Segment::This => PopThis,
+                    Segment::That => PopThat,
+                    Segment::Static => PopStatic,
+                    Segment::Temp => PopTemp,
+                    Segment::Pointer => PopPointer,
+                };
+                match locate(segment, index, static_base) {
+                    Location::Ram(address) => Instruction::new(opcode, address as u32, 0),
+                    _ => Instruction::new(opcode, index as u32, 0),
+                }
+            }
+            Command::CopySeg {
+                from_segment,
+                from_index,
+                to_segment,
+                to_index,
+            } => {
+                let from = locate(from_segment, from_index, static_base);
+                let to = locate(to_segment, to_index, static_base);
+                let (opcode, a, b) = match (from, to) {
+                    (_, Location::Constant) => {
+                        return self.trap(format!("can't pop into constant {}", to_index))
+                    }
+                    (Location::Constant, Location::Ram(to)) => {
+                        (CopyConstantToRam, from_index as u32, to as u32)
+                    }
+                    (Location::Constant, Location::Segment(to)) => (
+                        CopyConstantToSegment,
+                        from_index as u32,
+                        Instruction::segment_operand(to, to_index),
+                    ),
+                    (Location::Ram(from), Location::Ram(to)) => {
+                        (CopyRamToRam, from as u32, to as u32)
+                    }
+                    (Location::Ram(from), Location::Segment(to)) => (
+                        CopyRamToSegment,
+                        from as u32,
+                        Instruction::segment_operand(to, to_index),
+                    ),
+                    (Location::Segment(from), Location::Ram(to)) => (
+                        CopySegmentToRam,
+                        Instruction::segment_operand(from, from_index),
+                        to as u32,
+                    ),
+                    (Location::Segment(from), Location::Segment(to)) => (
+                        CopySegmentToSegment,
+                        Instruction::segment_operand(from, from_index),
+                        Instruction::segment_operand(to, to_index),
+                    ),
+                };
+                Instruction::new(opcode, a, b)
+            }
+            Command::Arithmetic(op) => {
+                let opcode = match op {
+                    Operation::Neg => Neg,
+                    Operation::Not => Not,
+                    Operation::Add => Add,
+                    Operation::Sub => Sub,
+                    Operation::And => And,
+                    Operation::Or => Or,
+                    Operation::Eq => Eq,
+                    Operation::Lt => Lt,
+                    Operation::Gt => Gt,
+                };
+                Instruction::new(opcode, 0, 0)
+            }
+            Command::Goto(index) => Instruction::new(Goto, index as u32, 0),
+            Command::If(index) => Instruction::new(If, index as u32, 0),
+            Command::Function(_, num_locals) => Instruction::new(Function, num_locals as u32, 0),
+            Command::Return => Instruction::new(Return, 0, 0),
+            Command::Call(func_ref, num_args) | Command::TailCall(func_ref, num_args) => {
+                let opcode = match command {
+                    Command::TailCall(_, _) => TailCall,
+                    _ => Call,
+                };
+                match func_ref {
+                    FunctionRef::Internal(index) => {
+                        Instruction::new(CallInternal, index as u32, num_args as u32)
+                    }
+                    FunctionRef::InCode(in_code_ref) => match self.function_id(&in_code_ref) {
+                        Some(id) => Instruction::new(opcode, id as u32, num_args as u32),
+                        None => self.trap(format!(
+                            "call to missing function {}",
+                            command.to_string(program)
+                        )),
+                    },
+                }
+            }
+        }
+    }
+}
+
+/// A program together with its threaded code. Neither changes once the
+/// program is linked, so emulators share one `Arc<LinkedProgram>` and only
+/// keep their own ram and call stack.
+pub struct LinkedProgram {
+    pub program: VMProgram,
+    pub code: ThreadedCode,
+}
+
+impl LinkedProgram {
+    pub fn new(program: VMProgram) -> LinkedProgram {
+        LinkedProgram {
+            code: ThreadedCode::from_program(&program),
+            program,
+        }
+    }
+
+    /// Lays out the threaded code hottest function first according to a
+    /// profile from an earlier run, to keep the code that runs most together.
+    pub fn with_profile(program: VMProgram, profile: &Profile) -> LinkedProgram {
+        LinkedProgram {
+            code: ThreadedCode::with_layout(&program, &profile.layout_order(&program)),
+            program,
+        }
+    }
+
+    pub fn empty() -> LinkedProgram {
+        LinkedProgram {
+            program: VMProgram::empty(),
+            code: ThreadedCode::empty(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_from_program() {
+        let program = VMProgram::new(&vec![
+            (
+                "Main.vm",
+                "
+                function Main.main 1
+                    push constant 3
+                    pop static 1
+                return",
+            ),
+            (
+                "Sys.vm",
+                "
+                function Sys.init 2
+                    push static 1
+                    pop local 1
+                    push temp 3
+                    push pointer 1
+                    add
+                    pop that 2
+                    call Main.main 0
+                return",
+            ),
+        ])
+        .unwrap();
+        let code = ThreadedCode::from_program(&program);
+        let main = program.get_function_ref("Main.main").unwrap();
+        let init = program.get_function_ref("Sys.init").unwrap();
+        assert_eq!(code.function_start(&main), 0);
+        assert_eq!(code.function_start(&init), 3);
+        assert_eq!(
+            code.instructions,
+            vec![
+                Instruction::new(Opcode::Function, 1, 0),
+                Instruction::new(Opcode::CopyConstantToRam, 3, 17),
+                Instruction::new(Opcode::Return, 0, 0),
+                Instruction::new(Opcode::Function, 2, 0),
+                Instruction::new(
+                    Opcode::CopyRamToSegment,
+                    16 + 2 + 1,
+                    Instruction::segment_operand(LCL, 1)
+                ),
+                Instruction::new(Opcode::PushTemp, 8, 0),
+                Instruction::new(Opcode::PushPointer, 4, 0),
+                Instruction::new(Opcode::Add, 0, 0),
+                Instruction::new(Opcode::PopThat, 2, 0),
+                Instruction::new(Opcode::Call, code.function_id(&main).unwrap() as u32, 0),
+                Instruction::new(Opcode::Return, 0, 0),
+            ]
+        );
+    }
+
+    #[test]
+    fn test_with_profile() {
+        let program = VMProgram::new(&vec![(
+            "Sys.vm",
+            "
+            function Sys.init 0
+                call Sys.hot 0
+            return
+            function Sys.hot 0
+                push constant 1
+            return",
+        )])
+        .unwrap();
+        let profile = Profile::from_text("hackvm profile 2\nSys.hot 10 20 20\n").unwrap();
+        let linked = LinkedProgram::with_profile(program, &profile);
+        let init = linked.program.get_function_ref("Sys.init").unwrap();
+        let hot = linked.program.get_function_ref("Sys.hot").unwrap();
+        assert_eq!(linked.code.function_start(&hot), 0);
+        assert_eq!(linked.code.function_start(&init), 3);
+        assert_eq!(
+            linked.code.instructions[3 + 1],
+            Instruction::new(
+                Opcode::Call,
+                linked.code.function_id(&hot).unwrap() as u32,
+                0
+            )
+        );
+        assert_eq!(linked.code.depths.len(), linked.code.instructions.len());
+    }
+}
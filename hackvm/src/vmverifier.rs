@@ -0,0 +1,182 @@
+use super::vmcommand::{Command, FunctionRef, Operation};
+use std::cmp;
+
+/// Net change in the size of the function stack caused by executing `command`.
+pub fn stack_effect(command: &Command) -> i32 {
+    match command {
+        Command::Arithmetic(Operation::Neg) | Command::Arithmetic(Operation::Not) => 0,
+        Command::Arithmetic(_) => -1,
+        Command::Push(_, _) => 1,
+        Command::Pop(_, _) => -1,
+        Command::If(_) => -1,
+        Command::Goto(_) => 0,
+        Command::Function(_, _) => 0,
+        Command::Return => -1,
+        Command::Call(_, num_args) | Command::TailCall(_, num_args) => 1 - *num_args as i32,
+        Command::CopySeg { .. } => 0,
+    }
+}
+
+/// Number of values a command takes off the function stack before pushing
+/// anything back.
+fn stack_inputs(command: &Command) -> i32 {
+    match command {
+        Command::Arithmetic(Operation::Neg) | Command::Arithmetic(Operation::Not) => 1,
+        Command::Arithmetic(_) => 2,
+        Command::Pop(_, _) | Command::If(_) | Command::Return => 1,
+        Command::Call(_, num_args) | Command::TailCall(_, num_args) => *num_args as i32,
+        _ => 0,
+    }
+}
+
+/// The function stack depth at each command of a function, as computed by
+/// `verify_stack_depths`.
+#[derive(Debug, PartialEq)]
+pub struct StackDepths {
+    /// Depth before each command is executed, or None if the command can't
+    /// be reached.
+    pub depths: Vec<Option<u16>>,
+    /// The most words the function ever has on its stack, including the
+    /// return address and saved segments pushed when it calls another function.
+    pub max_depth: usize,
+}
+
+/// Follows every path through a function to compute the stack depth at each
+/// command. Fails if two paths reach the same command with different depths,
+/// if a command pops more values than the function has pushed, or if control
+/// can leave the function without returning.
+///
+/// Functions that pass verification can't underflow their stack, so the
+/// emulator is free to skip its per-operation stack checks while running them.
+pub fn verify_stack_depths(commands: &[Command]) -> Result<StackDepths, String> {
+    let mut depths: Vec<Option<u16>> = vec![None; commands.len()];
+    let mut max_depth = 0;
+    let mut pending = vec![(0_usize, 0_i32)];
+    while let Some((index, depth)) = pending.pop() {
+        let command = match commands.get(index) {
+            Some(command) => command,
+            None => {
+                return Err(format!(
+                    "control reaches the end of the function at {}",
+                    index
+                ))
+            }
+        };
+        match depths[index] {
+            Some(seen) if seen as i32 == depth => continue,
+            Some(seen) => {
+                return Err(format!(
+                    "stack depth at {} is both {} and {}",
+                    index, seen, depth
+                ))
+            }
+            None => depths[index] = Some(depth as u16),
+        }
+        if depth < stack_inputs(command) {
+            return Err(format!(
+                "{} needs {} values but the stack has {} at {}",
+                match command {
+                    Command::Return => "return".to_string(),
+                    _ => format!("{:?}", command),
+                },
+                stack_inputs(command),
+                depth,
+                index
+            ));
+        }
+        let after = depth + stack_effect(command);
+        let peak = match command {
+            Command::Call(FunctionRef::InCode(_), _)
+            | Command::TailCall(FunctionRef::InCode(_), _) => depth + 5,
+            _ => cmp::max(depth, after),
+        };
+        max_depth = cmp::max(max_depth, peak as usize);
+        match command {
+            Command::Return => {}
+            Command::Goto(target) => pending.push((*target, after)),
+            Command::If(target) => {
+                pending.push((*target, after));
+                pending.push((index + 1, after));
+            }
+            _ => pending.push((index + 1, after)),
+        }
+    }
+    Ok(StackDepths { depths, max_depth })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::vmcommand::VMProgram;
+
+    fn commands(vm_code: &str) -> Vec<Command> {
+        let program = VMProgram::new(&vec![("Sys.vm", vm_code)]).unwrap();
+        program.files[0].functions[0].commands.clone()
+    }
+
+    #[test]
+    fn test_verify_stack_depths() {
+        let depths = verify_stack_depths(&commands(
+            "
+            function Sys.init 1
+                push constant 3
+                pop local 0
+                label LOOP
+                push local 0
+                push constant 0
+                eq
+                if-goto END
+                push local 0
+                push constant 1
+                sub
+                pop local 0
+                goto LOOP
+                label END
+                push local 0
+                push constant 2
+                call Sys.init 2
+            return
+                push constant 1
+            return",
+        ))
+        .unwrap();
+        let reachable: Vec<Option<u16>> = vec![0, 0, 0, 1, 2, 1, 0, 1, 2, 1, 0, 0, 1, 2, 1]
+            .into_iter()
+            .map(Some)
+            .collect();
+        assert_eq!(&depths.depths[..15], &reachable[..]);
+        assert_eq!(&depths.depths[15..], &[None, None]);
+        assert_eq!(depths.max_depth, 2 + 5);
+    }
+
+    #[test]
+    fn test_verify_stack_depths_rejects_bad_functions() {
+        let underflow = verify_stack_depths(&commands(
+            "
+            function Sys.init 0
+                push constant 1
+                add
+            return",
+        ));
+        assert!(underflow.unwrap_err().contains("needs 2 values"));
+
+        let inconsistent = verify_stack_depths(&commands(
+            "
+            function Sys.init 0
+                push constant 0
+                if-goto SKIP
+                push constant 1
+                label SKIP
+                push constant 2
+            return",
+        ));
+        assert!(inconsistent.unwrap_err().contains("is both"));
+
+        let falls_off_end = verify_stack_depths(&commands(
+            "
+            function Sys.init 0
+                push constant 0",
+        ));
+        assert!(falls_off_end.unwrap_err().contains("end of the function"));
+    }
+}
@@ -1,6 +1,6 @@
 const path = require("path");
 
-module.exports = function override(config, env) {
+function webpack(config, env) {
   const wasmExtensionRegExp = /\.wasm$/;
 
   config.resolve.extensions.push(".wasm");
@@ -21,5 +21,29 @@ module.exports = function override(config, env) {
     use: [{ loader: require.resolve("wasm-loader"), options: {} }],
   });
 
+  // *.worker.ts modules are bundled as web workers
+  config.module.rules.unshift({
+    test: /\.worker\.ts$/,
+    include: path.resolve(__dirname, "src"),
+    use: [{ loader: require.resolve("worker-loader") }],
+  });
+
   return config;
-};
+}
+
+// SharedArrayBuffer is only available to cross-origin isolated pages. Hosts
+// serving the production build need to send the same headers, or the
+// emulator falls back to running on the main thread.
+function devServer(configFunction) {
+  return function (proxy, allowedHost) {
+    const config = configFunction(proxy, allowedHost);
+    config.headers = {
+      ...config.headers,
+      "Cross-Origin-Opener-Policy": "same-origin",
+      "Cross-Origin-Embedder-Policy": "require-corp",
+    };
+    return config;
+  };
+}
+
+module.exports = { webpack, devServer };
@@ -1,4 +1,4 @@
-import { useState, useCallback, useEffect } from "react";
+import { useState, useCallback, useEffect, useMemo } from "react";
 import Row from "react-bootstrap/Row";
 import Col from "react-bootstrap/Col";
 import Form from "react-bootstrap/Form";
@@ -7,8 +7,13 @@ import Accordion from "react-bootstrap/Accordion";
 import IconButton from "./IconButton";
 import Spinner from "react-bootstrap/Spinner";
 import useHackMachine from "./useHackMachine";
-import type RustHackMachine from "./RustHackMachine";
+import type HackMachine from "./HackMachine";
+import type { MachineStats } from "./HackMachine";
 import safeInterval from "./safeInterval";
+import type { DebugState } from "./debugSnapshot";
+import { formatDebugState } from "./debugSnapshot";
+
+const DEBUG_PANEL = "1";
 
 type HackEmulatorProps = {
   urls: string[];
@@ -18,7 +23,15 @@ type HackEmulatorProps = {
 const HackEmulator = ({ urls, config, children }: HackEmulatorProps) => {
   const [speed, setSpeed] = useState(config.speed);
   const [numInstructions, setNumInstructions] = useState(0);
-  const [vmState, setVMState] = useState("");
+  const [stats, setStats] = useState<MachineStats>();
+  const [vmState, setVMState] = useState<DebugState>();
+  // the key of the open accordion panel, or "" when they're all closed
+  const [openPanel, setOpenPanel] = useState<string>(DEBUG_PANEL);
+  const debugOpen = openPanel === DEBUG_PANEL;
+  const vmStateText = useMemo(
+    () => (vmState ? formatDebugState(vmState) : ""),
+    [vmState]
+  );
 
   const {
     loading,
@@ -30,8 +43,9 @@ const HackEmulator = ({ urls, config, children }: HackEmulatorProps) => {
   } = useHackMachine(urls, {
     paused: false,
     speed,
-    onTick: useCallback((machine: RustHackMachine) => {
+    onTick: useCallback((machine: HackMachine) => {
       setNumInstructions(machine.numCycles / 1000);
+      setStats(machine.getStats());
     }, []),
   });
 
@@ -47,20 +61,23 @@ const HackEmulator = ({ urls, config, children }: HackEmulatorProps) => {
     }
     if (machine) {
       machine.tick(1);
-      setVMState(machine.getVM().get_debug());
+      debugOpen && machine.getDebug().then(setVMState);
     }
   };
 
+  // the state is only read while it's shown
   useEffect(() => {
     if (!machine) return;
+    if (!debugOpen) return;
+    machine.getDebug().then(setVMState);
     if (paused) return;
     const timeout = safeInterval(() => {
-      setVMState(machine?.getVM().get_debug());
+      machine.getDebug().then(setVMState);
     }, 500);
     return () => {
       clearInterval(timeout);
     };
-  }, [machine, paused]);
+  }, [machine, paused, debugOpen]);
 
   return (
     <Row>
@@ -110,7 +127,10 @@ const HackEmulator = ({ urls, config, children }: HackEmulatorProps) => {
       </Col>
       <Col md={4}>
         {children}
-        <Accordion defaultActiveKey="1">
+        <Accordion
+          activeKey={openPanel}
+          onSelect={(key) => setOpenPanel(key ?? "")}
+        >
           <Card>
             <Accordion.Toggle as={Card.Header} eventKey="0">
               Configuration
@@ -119,27 +139,38 @@ const HackEmulator = ({ urls, config, children }: HackEmulatorProps) => {
               <Card.Body>
                 <Form>
                   <Form.Group>
-                    <Form.Label>Steps / Cycle: {speed}</Form.Label>
+                    <Form.Label>
+                      Steps / Second: {speed.toLocaleString()}
+                    </Form.Label>
                     <Form.Control
                       type="range"
-                      min={500}
-                      max={100000}
+                      min={100000}
+                      max={20000000}
+                      step={100000}
                       value={speed}
                       className="form-range"
                       onChange={(e) => setSpeed(parseInt(e.target.value))}
                     />
+                    {stats && (
+                      <Form.Text muted>
+                        Running at{" "}
+                        {Math.round(stats.stepsPerSecond).toLocaleString()}{" "}
+                        steps / second, {stats.averageSliceMs.toFixed(1)}ms
+                        per slice ({stats.maxSliceMs.toFixed(1)}ms max)
+                      </Form.Text>
+                    )}
                   </Form.Group>
                 </Form>
               </Card.Body>
             </Accordion.Collapse>
           </Card>
           <Card>
-            <Accordion.Toggle as={Card.Header} eventKey="1">
+            <Accordion.Toggle as={Card.Header} eventKey={DEBUG_PANEL}>
               Internal VM State
             </Accordion.Toggle>
-            <Accordion.Collapse eventKey="1">
+            <Accordion.Collapse eventKey={DEBUG_PANEL}>
               <Card.Body>
-                <pre>{vmState}</pre>
+                <pre>{vmStateText}</pre>
               </Card.Body>
             </Accordion.Collapse>
           </Card>
@@ -0,0 +1,62 @@
+import type { Program } from "./workerProtocol";
+import type { DebugState } from "./debugSnapshot";
+
+export type MachineStats = {
+  stepsPerSecond: number;
+  averageSliceMs: number;
+  maxSliceMs: number;
+};
+
+// What the UI needs from a running machine, whether it runs on the main
+// thread (RustHackMachine) or in a worker (WorkerHackMachine).
+export default interface HackMachine {
+  readonly numCycles: number;
+  // runs at `speed` steps per second, or as fast as it can if it's 0, until
+  // stopped
+  start(speed: number): void;
+  stop(): void;
+  tick(n: number): void;
+  reset(): void;
+  setKeyboard(event: { key: string } | null): void;
+  drawScreen(ctx: CanvasRenderingContext2D): void;
+  getStats(): MachineStats;
+  getDebug(): Promise<DebugState>;
+  destroy(): void;
+}
+
+export function getKeyValue(key: string) {
+  const keyMap: Record<string, number> = {
+    ArrowLeft: 130,
+    ArrowUp: 131,
+    ArrowRight: 132,
+    ArrowDown: 133,
+  };
+  let value = 0;
+  value = keyMap[key];
+  if (value === undefined) {
+    value = key.charCodeAt(0);
+  }
+  return value;
+}
+
+// Shared memory is only available when the page is cross-origin isolated,
+// which needs headers that not every host can send.
+export function canRunInWorker(): boolean {
+  return (
+    typeof SharedArrayBuffer !== "undefined" &&
+    (window as any).crossOriginIsolated !== false
+  );
+}
+
+export async function createHackMachine(
+  program: Program
+): Promise<HackMachine> {
+  if (canRunInWorker()) {
+    const { default: WorkerHackMachine } = await import(
+      "./WorkerHackMachine"
+    );
+    return WorkerHackMachine.create(program);
+  }
+  const { default: RustHackMachine } = await import("./RustHackMachine");
+  return RustHackMachine.create(program);
+}
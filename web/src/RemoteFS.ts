@@ -1,12 +1,18 @@
 export type FetchState = {
   loading: boolean;
-  error: Response | null;
+  error: Response | Error | null;
   data: string;
   url: string;
 };
 
 type RemoteFSSubscription = (s: FetchState) => void;
 
+// Browsers only open a handful of connections per host anyway, and more
+// requests in flight would just queue up there instead.
+const MAX_CONCURRENT_FETCHES = 6;
+// Responses are kept here across visits and revalidated with their ETag.
+const CACHE_NAME = "hackvm-programs-v1";
+
 export default class RemoteFS {
   private static instance: RemoteFS;
   static get() {
@@ -18,6 +24,8 @@ export default class RemoteFS {
 
   private state: Record<string, FetchState> = {};
   private subscribers: Record<string, RemoteFSSubscription[]> = {};
+  private activeFetches = 0;
+  private queuedFetches: (() => void)[] = [];
 
   private constructor() {}
 
@@ -47,20 +55,82 @@ export default class RemoteFS {
     }
   }
 
+  // Runs `task` once fewer than MAX_CONCURRENT_FETCHES are running.
+  private async limit<T>(task: () => Promise<T>): Promise<T> {
+    if (this.activeFetches >= MAX_CONCURRENT_FETCHES) {
+      await new Promise<void>((resolve) => this.queuedFetches.push(resolve));
+    }
+    this.activeFetches++;
+    try {
+      return await task();
+    } finally {
+      this.activeFetches--;
+      this.queuedFetches.shift()?.();
+    }
+  }
+
+  // Fetches `url`, answering from the persistent cache when the server says
+  // the cached copy's ETag is still current, or when the network is down.
+  // The cache is only an optimization, so if it fails (storage disabled,
+  // quota exceeded) this falls back to a plain fetch.
+  private fetchCached(url: string): Promise<Response> {
+    return this.limit(async () => {
+      let cache: Cache | undefined;
+      let cached: Response | undefined;
+      try {
+        if (typeof caches !== "undefined") {
+          cache = await caches.open(CACHE_NAME);
+          cached = await cache.match(url);
+        }
+      } catch (e) {
+        cache = cached = undefined;
+      }
+      if (!cache) {
+        return fetch(url);
+      }
+      const etag = cached?.headers.get("ETag");
+      let res;
+      try {
+        res = await fetch(url, {
+          headers: etag ? { "If-None-Match": etag } : {},
+          // the cache below replaces the HTTP cache's revalidation
+          cache: "no-store",
+        });
+      } catch (e) {
+        if (cached) return cached;
+        throw e;
+      }
+      if (res.status === 304 && cached) {
+        return cached;
+      }
+      if (res.ok && res.headers.get("ETag")) {
+        try {
+          await cache.put(url, res.clone());
+        } catch (e) {
+          // the response is still good, it just won't be cached
+        }
+      }
+      return res;
+    });
+  }
+
   addFile(url: string, callback?: RemoteFSSubscription) {
     if (!this.state[url]) {
       this.state[url] = { loading: true, error: null, url, data: "" };
-      fetch(url).then((res) => {
-        if (res.ok) {
-          res.text().then((data) => {
+      this.fetchCached(url)
+        .then(async (res) => {
+          if (res.ok) {
+            const data = await res.text();
             this.state[url] = { loading: false, error: null, url, data };
-            this.notifySubscribers(url);
-          });
-        } else {
-          this.state[url] = { loading: false, error: res, url, data: "" };
+          } else {
+            this.state[url] = { loading: false, error: res, url, data: "" };
+          }
           this.notifySubscribers(url);
-        }
-      });
+        })
+        .catch((error) => {
+          this.state[url] = { loading: false, error, url, data: "" };
+          this.notifySubscribers(url);
+        });
     }
 
     if (callback) {
@@ -88,11 +158,15 @@ export default class RemoteFS {
   }
 
   async getFiles(urls: string[]): Promise<FetchState[]> {
-    let files: FetchState[] = [];
-    for (const url of urls) {
-      const file = await this.getFile(url);
-      files.push(file);
+    return Promise.all(urls.map((url) => this.getFile(url)));
+  }
+
+  // Fetches a binary file, like a program precompiled by WebVM.precompile.
+  async getBytes(url: string): Promise<Uint8Array> {
+    const res = await this.fetchCached(url);
+    if (!res.ok) {
+      throw res;
     }
-    return files;
+    return new Uint8Array(await res.arrayBuffer());
   }
 }
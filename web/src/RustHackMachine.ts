@@ -1,42 +1,43 @@
 import type { WebVM } from "hackvm";
+import type HackMachine from "./HackMachine";
+import type { MachineStats } from "./HackMachine";
+import { getKeyValue } from "./HackMachine";
+import type { DebugState } from "./debugSnapshot";
+import { parseDebugSnapshot } from "./debugSnapshot";
+import safeInterval from "./safeInterval";
+import { loadProgram } from "./loadProgram";
+import type { Program } from "./workerProtocol";
 
-function getKeyValue(key: string) {
-  const keyMap: Record<string, number> = {
-    ArrowLeft: 130,
-    ArrowUp: 131,
-    ArrowRight: 132,
-    ArrowDown: 133,
-  };
-  let value = 0;
-  value = keyMap[key];
-  if (value === undefined) {
-    value = key.charCodeAt(0);
-  }
-  return value;
-}
+// Slices are kept to half a 60Hz frame, leaving the rest for the page.
+const SLICE_BUDGET_MS = 8;
 
-export default class RustHackMachine {
-  static async create(program: {
-    vmFiles: { filename: string; text: string }[];
-  }): Promise<RustHackMachine> {
+// Runs the VM on the main thread, for pages that can't use shared memory.
+export default class RustHackMachine implements HackMachine {
+  static async create(program: Program): Promise<RustHackMachine> {
     const hack = await import("hackvm");
     hack.init_panic_hook();
     let machine;
 
     machine = hack.WebVM.new();
-    for (let file of program.vmFiles) {
-      machine.load_file(file.filename, file.text);
-    }
-    machine.init();
+    loadProgram(machine, program);
 
-    return new RustHackMachine(machine);
+    return new RustHackMachine(machine, hack.wasm_memory());
   }
 
   private m: WebVM;
+  private memory: WebAssembly.Memory;
   private profile: boolean;
-  private constructor(m: WebVM) {
+  // a view of the VM's framebuffer, and the context it was last drawn to
+  private screen: ImageData | null = null;
+  private drawnContext: CanvasRenderingContext2D | null = null;
+  private interval: ReturnType<typeof safeInterval> | null = null;
+  private functionNames: string[];
+  private snapshot = new Int32Array(256);
+  private constructor(m: WebVM, memory: WebAssembly.Memory) {
     this.m = m;
+    this.memory = memory;
     this.profile = false;
+    this.functionNames = m.function_names().split("\n");
   }
 
   numCycles: number = 0;
@@ -48,6 +49,20 @@ export default class RustHackMachine {
     }
     this.numCycles += n;
   }
+  start(speed: number): void {
+    this.stop();
+    this.m.set_target_speed(speed);
+    this.interval = safeInterval(() => {
+      this.numCycles += this.m.run_slice(performance.now(), SLICE_BUDGET_MS);
+      this.m.end_slice(performance.now());
+    }, 0);
+  }
+  stop(): void {
+    if (this.interval !== null) {
+      clearInterval(this.interval);
+      this.interval = null;
+    }
+  }
   reset(): void {
     this.m.reset();
     this.numCycles = 0;
@@ -60,7 +75,62 @@ export default class RustHackMachine {
     this.m.set_keyboard(event ? getKeyValue(event.key) : 0);
   }
   drawScreen(ctx: CanvasRenderingContext2D): void {
-    this.m.draw_screen(ctx);
+    // skip the conversion and the blit unless there's something new to show
+    if (ctx === this.drawnContext && !this.m.screen_changed()) {
+      return;
+    }
+    this.m.update_framebuffer();
+    // growing wasm memory detaches views of the old buffer
+    if (
+      this.screen === null ||
+      this.screen.data.buffer !== this.memory.buffer
+    ) {
+      const pixels = new Uint8ClampedArray(
+        this.memory.buffer,
+        this.m.framebuffer_ptr(),
+        this.m.framebuffer_len()
+      );
+      this.screen = new ImageData(pixels, 512, 256);
+    }
+    if (ctx === this.drawnContext) {
+      // the canvas still shows the last frame, so only the changes are put
+      ctx.putImageData(
+        this.screen,
+        0,
+        0,
+        this.m.dirty_x(),
+        this.m.dirty_y(),
+        this.m.dirty_width(),
+        this.m.dirty_height()
+      );
+    } else {
+      ctx.putImageData(this.screen, 0, 0);
+    }
+    this.drawnContext = ctx;
+  }
+  getStats(): MachineStats {
+    return {
+      stepsPerSecond: this.m.steps_per_second(),
+      averageSliceMs: this.m.average_slice_ms(),
+      maxSliceMs: this.m.max_slice_ms(),
+    };
+  }
+  getDebug(): Promise<DebugState> {
+    let length = this.m.fill_debug_snapshot(this.snapshot);
+    if (length > this.snapshot.length) {
+      this.snapshot = new Int32Array(length * 2);
+      this.m.fill_debug_snapshot(this.snapshot);
+    }
+    return Promise.resolve(
+      parseDebugSnapshot(
+        this.snapshot.subarray(0, length),
+        this.functionNames,
+        this.m.next_command()
+      )
+    );
+  }
+  destroy(): void {
+    this.stop();
   }
   getVM(): WebVM {
     return this.m;
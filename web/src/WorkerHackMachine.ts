@@ -0,0 +1,168 @@
+import type HackMachine from "./HackMachine";
+import type { MachineStats } from "./HackMachine";
+import { getKeyValue } from "./HackMachine";
+import type { DebugState } from "./debugSnapshot";
+import { parseDebugSnapshot } from "./debugSnapshot";
+import HackWorker from "./hackvm.worker";
+import {
+  Program,
+  ToWorker,
+  FromWorker,
+  GENERATION,
+  DRAWN,
+  DIRTY_LEFT,
+  DIRTY_TOP,
+  DIRTY_RIGHT,
+  DIRTY_BOTTOM,
+  KEYBOARD,
+  CONTROL_SLOTS,
+  CYCLES,
+  STEPS_PER_SECOND,
+  AVERAGE_SLICE_MS,
+  MAX_SLICE_MS,
+  STATS_SLOTS,
+  SCREEN_WIDTH,
+  SCREEN_HEIGHT,
+  PIXEL_BYTES,
+} from "./workerProtocol";
+
+// Drives a VM running in hackvm.worker.ts. The worker publishes frames,
+// cycle counts and speed stats through shared memory, so drawing and reading
+// them never wait on it.
+export default class WorkerHackMachine implements HackMachine {
+  static create(program: Program): Promise<WorkerHackMachine> {
+    const machine = new WorkerHackMachine(new HackWorker());
+    return new Promise((resolve, reject) => {
+      machine.onReady = () => {
+        // later errors come from the running machine and have no promise left
+        // to reject, so they're thrown like the main thread runtime's
+        machine.onError = (error) => {
+          throw error;
+        };
+        resolve(machine);
+      };
+      machine.onError = (error) => {
+        machine.destroy();
+        reject(error);
+      };
+      machine.post({
+        type: "load",
+        program,
+        control: machine.control.buffer as SharedArrayBuffer,
+        stats: machine.stats.buffer as SharedArrayBuffer,
+        pixels: machine.pixels.buffer as SharedArrayBuffer,
+      });
+    });
+  }
+
+  private worker: Worker;
+  private control = new Int32Array(
+    new SharedArrayBuffer(CONTROL_SLOTS * Int32Array.BYTES_PER_ELEMENT)
+  );
+  private stats = new Float64Array(
+    new SharedArrayBuffer(STATS_SLOTS * Float64Array.BYTES_PER_ELEMENT)
+  );
+  private pixels = new Uint8ClampedArray(new SharedArrayBuffer(PIXEL_BYTES));
+  // ImageData can't be backed by shared memory, so frames are copied into
+  // this one before they are put on the canvas
+  private screen = new ImageData(SCREEN_WIDTH, SCREEN_HEIGHT);
+  private drawnContext: CanvasRenderingContext2D | null = null;
+  private onReady = () => {};
+  private onError = (error: Error) => {
+    throw error;
+  };
+  private functionNames: string[] = [];
+  private debugRequests: ((state: DebugState) => void)[] = [];
+
+  private constructor(worker: Worker) {
+    this.worker = worker;
+    this.control[DRAWN] = -1;
+    worker.onmessage = (event: MessageEvent<FromWorker>) => {
+      const message = event.data;
+      switch (message.type) {
+        case "ready":
+          this.functionNames = message.functionNames;
+          this.onReady();
+          break;
+        case "error":
+          this.onError(new Error(message.message));
+          break;
+        case "debug":
+          this.debugRequests.shift()?.(
+            parseDebugSnapshot(
+              message.snapshot,
+              this.functionNames,
+              message.nextCommand
+            )
+          );
+          break;
+      }
+    };
+  }
+
+  private post(message: ToWorker) {
+    this.worker.postMessage(message);
+  }
+
+  get numCycles(): number {
+    return this.stats[CYCLES];
+  }
+  start(speed: number): void {
+    this.post({ type: "run", speed });
+  }
+  stop(): void {
+    this.post({ type: "pause" });
+  }
+  tick(n: number): void {
+    this.post({ type: "step", steps: n });
+  }
+  reset(): void {
+    this.post({ type: "reset" });
+  }
+  setKeyboard(event: { key: string } | null): void {
+    Atomics.store(this.control, KEYBOARD, event ? getKeyValue(event.key) : 0);
+  }
+  drawScreen(ctx: CanvasRenderingContext2D): void {
+    const generation = Atomics.load(this.control, GENERATION);
+    if (
+      generation === Atomics.load(this.control, DRAWN) &&
+      ctx === this.drawnContext
+    ) {
+      return;
+    }
+    let left = 0;
+    let top = 0;
+    let right = SCREEN_WIDTH;
+    let bottom = SCREEN_HEIGHT;
+    if (ctx === this.drawnContext) {
+      left = Atomics.load(this.control, DIRTY_LEFT);
+      top = Atomics.load(this.control, DIRTY_TOP);
+      right = Atomics.load(this.control, DIRTY_RIGHT);
+      bottom = Atomics.load(this.control, DIRTY_BOTTOM);
+    }
+    for (let row = top; row < bottom; row++) {
+      const start = (row * SCREEN_WIDTH + left) * 4;
+      const end = (row * SCREEN_WIDTH + right) * 4;
+      this.screen.data.set(this.pixels.subarray(start, end), start);
+    }
+    ctx.putImageData(this.screen, 0, 0, left, top, right - left, bottom - top);
+    Atomics.store(this.control, DRAWN, generation);
+    this.drawnContext = ctx;
+  }
+  getStats(): MachineStats {
+    return {
+      stepsPerSecond: this.stats[STEPS_PER_SECOND],
+      averageSliceMs: this.stats[AVERAGE_SLICE_MS],
+      maxSliceMs: this.stats[MAX_SLICE_MS],
+    };
+  }
+  getDebug(): Promise<DebugState> {
+    return new Promise((resolve) => {
+      this.debugRequests.push(resolve);
+      this.post({ type: "debug" });
+    });
+  }
+  destroy(): void {
+    this.worker.terminate();
+  }
+}
@@ -0,0 +1,96 @@
+// Decodes the numbers written by WebVM.fill_debug_snapshot; see
+// VMEmulator::debug_snapshot for the layout. Formatting is left to
+// formatDebugState, so that it only happens when the state is shown.
+
+export type DebugFrame = {
+  function: string;
+  // the function inlined at the frame's position, if any
+  inlined?: string;
+  index: number;
+};
+
+export type DebugState = {
+  step: number;
+  pointers: {
+    SP: number;
+    LCL: number;
+    ARG: number;
+    THIS: number;
+    THAT: number;
+  };
+  callStack: DebugFrame[];
+  segments: Record<SegmentName, Int32Array>;
+  nextCommand?: string;
+};
+
+const SEGMENTS = [
+  "Stack",
+  "Static",
+  "Temp",
+  "Local",
+  "Argument",
+  "Pointer",
+] as const;
+type SegmentName = typeof SEGMENTS[number];
+
+export function parseDebugSnapshot(
+  data: Int32Array,
+  functionNames: string[],
+  nextCommand?: string
+): DebugState {
+  let at = 0;
+  const next = () => data[at++];
+  const name = (id: number) => functionNames[id] ?? "Unknown Function";
+
+  const step = (next() >>> 0) + next() * 2 ** 32;
+  const [SP, LCL, ARG, THIS, THAT] = [next(), next(), next(), next(), next()];
+  const callStack: DebugFrame[] = [];
+  for (let frames = next(); frames > 0; frames--) {
+    const func = next();
+    const inlined = next();
+    callStack.push({
+      function: name(func),
+      inlined: inlined >= 0 ? name(inlined) : undefined,
+      index: next(),
+    });
+  }
+  const segments = {} as Record<SegmentName, Int32Array>;
+  for (const segment of SEGMENTS) {
+    const length = next();
+    segments[segment] = data.slice(at, at + length);
+    at += length;
+  }
+  return {
+    step,
+    pointers: { SP, LCL, ARG, THIS, THAT },
+    callStack,
+    segments,
+    nextCommand,
+  };
+}
+
+export function formatDebugState(state: DebugState): string {
+  const lines = [`Step: ${state.step}`];
+  lines.push(
+    "Pointers: " +
+      Object.entries(state.pointers)
+        .map(([pointer, value]) => `${pointer}=${value}`)
+        .join(" ")
+  );
+  lines.push("Call Stack:");
+  for (const frame of state.callStack) {
+    lines.push(`  ${frame.function}[${frame.index}]`);
+    if (frame.inlined) {
+      lines.push(`  ${frame.inlined} (inlined)`);
+    }
+  }
+  const list = (values: Int32Array) => `[${Array.from(values).join(", ")}]`;
+  lines.push(`Function Stack: ${list(state.segments.Stack)}`);
+  for (const segment of SEGMENTS.slice(1)) {
+    lines.push(`${segment} Segment: ${list(state.segments[segment])}`);
+  }
+  if (state.nextCommand) {
+    lines.push(`Next Command: ${state.nextCommand}`);
+  }
+  return lines.join("\n");
+}
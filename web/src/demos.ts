@@ -17,6 +17,7 @@ type Demo = {
   author: string;
   ticksPerCycle?: number;
   instructions?: string;
+  // speed is in VM steps per second
   config?: { speed?: number };
 };
 
@@ -28,7 +29,7 @@ const demos: Record<string, Demo> = {
     author: "Noam Nisan and Shimon Schocken (creators of Nand2Tetris)",
     projectUrl: "https://www.nand2tetris.org/",
     instructions: "Use the arrow keys to move the paddle.",
-    config: { speed: 5000 },
+    config: { speed: 1250000 },
     files: [
       "programs/Pong/Bat.vm",
       "programs/Pong/Ball.vm",
@@ -53,7 +54,7 @@ const demos: Record<string, Demo> = {
     description: "A demo of scrolling text across the screen.",
     author: "Gavin Stewart",
     projectUrl: "https://github.com/gav-/Nand2Tetris-Games_and_Demos",
-    config: { speed: 5000 },
+    config: { speed: 1250000 },
     files: [
       "https://raw.githubusercontent.com/gav-/Nand2Tetris-Games_and_Demos/master/GASscroller/GASscroller.vm",
       "https://raw.githubusercontent.com/gav-/Nand2Tetris-Games_and_Demos/master/GASscroller/Main.vm",
@@ -87,7 +88,7 @@ const demos: Record<string, Demo> = {
     description: "A bouncing ball animation.",
     author: "Gavin Stewart",
     projectUrl: "https://github.com/gav-/Nand2Tetris-Games_and_Demos",
-    config: { speed: 5000 },
+    config: { speed: 1250000 },
     files: [
       "https://raw.githubusercontent.com/gav-/Nand2Tetris-Games_and_Demos/master/GASboing/GASboing.vm",
       "https://raw.githubusercontent.com/gav-/Nand2Tetris-Games_and_Demos/master/GASboing/Image.vm",
@@ -0,0 +1,180 @@
+import type { WebVM } from "hackvm";
+import { loadProgram } from "./loadProgram";
+import {
+  ToWorker,
+  FromWorker,
+  GENERATION,
+  DRAWN,
+  DIRTY_LEFT,
+  DIRTY_TOP,
+  DIRTY_RIGHT,
+  DIRTY_BOTTOM,
+  KEYBOARD,
+  CYCLES,
+  STEPS_PER_SECOND,
+  AVERAGE_SLICE_MS,
+  MAX_SLICE_MS,
+  SCREEN_WIDTH,
+} from "./workerProtocol";
+
+// Runs a WebVM off the main thread. Frames are copied into a shared pixel
+// buffer as they change, and the keyboard is read from the control buffer,
+// so the only messages are for loading and controlling the machine.
+
+// Slices can be longer than on the main thread, as nothing else runs here,
+// but they're kept short enough for pausing to feel immediate.
+const SLICE_BUDGET_MS = 16;
+
+const worker: Worker = self as any;
+
+let vm: WebVM;
+let memory: WebAssembly.Memory;
+let control: Int32Array;
+let stats: Float64Array;
+let pixels: Uint8ClampedArray;
+let drawnGeneration = -1;
+let snapshot = new Int32Array(256);
+let running = false;
+// bumped whenever the machine starts running, so that slices still scheduled
+// from before a pause don't run alongside the new ones
+let run = 0;
+
+// setTimeout(0) is clamped to 4ms when nested, which would leave the worker
+// idle most of the time, so the run loop yields through a message channel.
+const yielder = new MessageChannel();
+yielder.port1.onmessage = (event) => runSlice(event.data);
+
+function post(message: FromWorker) {
+  worker.postMessage(message);
+}
+
+function runSlice(id: number) {
+  if (!running || id !== run) return;
+  const start = performance.now();
+  try {
+    vm.set_keyboard(Atomics.load(control, KEYBOARD));
+    stats[CYCLES] += vm.run_slice(start, SLICE_BUDGET_MS);
+    vm.end_slice(performance.now());
+    publishFrame();
+  } catch (e) {
+    running = false;
+    post({ type: "error", message: String(e) });
+    return;
+  }
+  stats[STEPS_PER_SECOND] = vm.steps_per_second();
+  stats[AVERAGE_SLICE_MS] = vm.average_slice_ms();
+  stats[MAX_SLICE_MS] = vm.max_slice_ms();
+  if (performance.now() - start < SLICE_BUDGET_MS / 2) {
+    // ahead of the target speed, so there's no hurry
+    setTimeout(() => runSlice(id), 0);
+  } else {
+    yielder.port2.postMessage(id);
+  }
+}
+
+function step(steps: number) {
+  vm.set_keyboard(Atomics.load(control, KEYBOARD));
+  vm.tick(steps);
+  stats[CYCLES] += steps;
+  publishFrame();
+}
+
+function publishFrame() {
+  const generation = vm.update_framebuffer();
+  if (generation === drawnGeneration) return;
+  drawnGeneration = generation;
+
+  const x = vm.dirty_x();
+  const y = vm.dirty_y();
+  const width = vm.dirty_width();
+  const height = vm.dirty_height();
+  const framebuffer = new Uint8ClampedArray(
+    memory.buffer,
+    vm.framebuffer_ptr(),
+    vm.framebuffer_len()
+  );
+  for (let row = y; row < y + height; row++) {
+    const start = (row * SCREEN_WIDTH + x) * 4;
+    pixels.set(framebuffer.subarray(start, start + width * 4), start);
+  }
+
+  const published = Atomics.load(control, GENERATION);
+  if (Atomics.load(control, DRAWN) === published) {
+    // the main thread has drawn everything published so far
+    Atomics.store(control, DIRTY_LEFT, x);
+    Atomics.store(control, DIRTY_TOP, y);
+    Atomics.store(control, DIRTY_RIGHT, x + width);
+    Atomics.store(control, DIRTY_BOTTOM, y + height);
+  } else {
+    grow(DIRTY_LEFT, x, Math.min);
+    grow(DIRTY_TOP, y, Math.min);
+    grow(DIRTY_RIGHT, x + width, Math.max);
+    grow(DIRTY_BOTTOM, y + height, Math.max);
+  }
+  Atomics.store(control, GENERATION, published + 1);
+}
+
+function grow(
+  slot: number,
+  value: number,
+  f: (a: number, b: number) => number
+) {
+  Atomics.store(control, slot, f(Atomics.load(control, slot), value));
+}
+
+worker.onmessage = async (event: MessageEvent<ToWorker>) => {
+  const message = event.data;
+  try {
+    switch (message.type) {
+      case "load": {
+        const hack = await import("hackvm");
+        hack.init_panic_hook();
+        memory = hack.wasm_memory();
+        control = new Int32Array(message.control);
+        stats = new Float64Array(message.stats);
+        pixels = new Uint8ClampedArray(message.pixels);
+        vm = hack.WebVM.new();
+        loadProgram(vm, message.program);
+        publishFrame();
+        post({ type: "ready", functionNames: vm.function_names().split("\n") });
+        break;
+      }
+      case "run":
+        vm.set_target_speed(message.speed);
+        if (!running) {
+          running = true;
+          runSlice(++run);
+        }
+        break;
+      case "pause":
+        running = false;
+        break;
+      case "step":
+        step(message.steps);
+        break;
+      case "reset":
+        vm.reset();
+        stats[CYCLES] = 0;
+        publishFrame();
+        break;
+      case "debug": {
+        let length = vm.fill_debug_snapshot(snapshot);
+        if (length > snapshot.length) {
+          snapshot = new Int32Array(length * 2);
+          vm.fill_debug_snapshot(snapshot);
+        }
+        post({
+          type: "debug",
+          snapshot: snapshot.slice(0, length),
+          nextCommand: vm.next_command(),
+        });
+        break;
+      }
+    }
+  } catch (e) {
+    post({ type: "error", message: String(e) });
+  }
+};
+
+// worker-loader replaces this module with a constructor for the worker
+export default (null as unknown) as { new (): Worker };
@@ -0,0 +1,13 @@
+import type { WebVM } from "hackvm";
+import type { Program } from "./workerProtocol";
+
+export function loadProgram(vm: WebVM, program: Program) {
+  if ("precompiled" in program) {
+    vm.init_precompiled(program.precompiled);
+    return;
+  }
+  for (let file of program.vmFiles) {
+    vm.load_file(file.filename, file.text);
+  }
+  vm.init();
+}
@@ -14,7 +14,7 @@ function EmulatorPage() {
     return <Container>No demo found at this url.</Container>;
   }
   const urls = demo ? [...demo.files, ...OSFiles] : [];
-  const defaultConfig = { speed: 20000 };
+  const defaultConfig = { speed: 5000000 };
   const config =
     demo && demo.config ? { ...defaultConfig, ...demo.config } : defaultConfig;
 
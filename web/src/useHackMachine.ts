@@ -1,7 +1,25 @@
 import { useEffect, useState, useRef, useCallback } from "react";
-import RustHackMachine from "./RustHackMachine";
+import type HackMachine from "./HackMachine";
+import { createHackMachine } from "./HackMachine";
 import RemoteFS from "./RemoteFS";
 import safeInterval from "./safeInterval";
+import type { Program } from "./workerProtocol";
+
+// Programs are either .vm files, or a single .hvmb file made by
+// WebVM.precompile, which needs one request and no linking.
+async function fetchProgram(urls: string[]): Promise<Program> {
+  const remoteFS = RemoteFS.get();
+  if (urls.length === 1 && urls[0].endsWith(".hvmb")) {
+    return { precompiled: await remoteFS.getBytes(urls[0]) };
+  }
+  const fetched = await remoteFS.getFiles(urls);
+  const vmFiles = fetched.map((fetchState) => {
+    const parts = fetchState.url.split("/");
+    const filename = parts[parts.length - 1];
+    return { filename, text: fetchState.data };
+  });
+  return { vmFiles };
+}
 
 export default function useHackMachine(
   url: string[],
@@ -11,12 +29,12 @@ export default function useHackMachine(
     paused: initPaused = true,
   }: {
     speed: number;
-    onTick?: (machine: RustHackMachine, elapsedTimeMs: number) => void;
+    onTick?: (machine: HackMachine, elapsedTimeMs: number) => void;
     paused?: boolean;
   }
 ) {
   const [loading, setLoading] = useState(false);
-  const [machine, setMachine] = useState<RustHackMachine>();
+  const [machine, setMachine] = useState<HackMachine>();
   const [paused, setPaused] = useState(initPaused);
 
   const canvasRef = useRef<HTMLCanvasElement>(null);
@@ -29,25 +47,31 @@ export default function useHackMachine(
     context &&
       context.clearRect(0, 0, context.canvas.width, context.canvas.height);
 
+    let cancelled = false;
     (async () => {
-      const fetched = await RemoteFS.get().getFiles(url);
-      const vmFiles = fetched.map((fetchState) => {
-        const parts = fetchState.url.split("/");
-        const filename = parts[parts.length - 1];
-        return { filename, text: fetchState.data };
-      });
-      setMachine(await RustHackMachine.create({ vmFiles }));
+      const created = await createHackMachine(await fetchProgram(url));
+      if (cancelled) {
+        created.destroy();
+        return;
+      }
+      setMachine(created);
       setLoading(false);
     })();
+    return () => {
+      cancelled = true;
+    };
   }, [url]);
 
+  useEffect(() => {
+    if (!machine) return;
+    return () => machine.destroy();
+  }, [machine]);
+
   useEffect(() => {
     if (!machine) return;
     if (paused) return;
     const startTime = new Date().getTime();
-    const computeInterval = safeInterval(() => {
-      machine?.tick(speed);
-    }, 0);
+    machine.start(speed);
     let onTickInterval: NodeJS.Timeout;
     if (onTick) {
       onTickInterval = safeInterval(
@@ -57,22 +81,24 @@ export default function useHackMachine(
     }
     return () => {
       onTickInterval && clearInterval(onTickInterval);
-      clearInterval(computeInterval);
+      machine.stop();
     };
   }, [machine, paused, onTick, speed]);
 
+  // Frames where the screen didn't change cost a single flag check, so this
+  // keeps going while paused, to show single steps and resets.
   useEffect(() => {
-    if (paused) return;
     if (!machine) return;
     const context = canvasRef.current?.getContext("2d");
     if (!context) return;
-    const renderInterval = safeInterval(() => {
+    let frame = requestAnimationFrame(function render() {
       machine.drawScreen(context);
-    }, 1000 / 30);
+      frame = requestAnimationFrame(render);
+    });
     return () => {
-      clearInterval(renderInterval);
+      cancelAnimationFrame(frame);
     };
-  }, [paused, machine]);
+  }, [machine]);
 
   const onKeyDown = useCallback(
     (event: KeyboardEvent) => {
@@ -98,8 +124,6 @@ export default function useHackMachine(
   const reset = () => {
     if (!machine) return;
     machine.reset();
-    const context = canvasRef.current?.getContext("2d");
-    context && machine.drawScreen(context);
     onTick && onTick(machine, 0);
   };
 
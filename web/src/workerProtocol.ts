@@ -0,0 +1,53 @@
+// Messages and shared memory layout between WorkerHackMachine and the worker
+// in hackvm.worker.ts.
+
+export type VMFile = { filename: string; text: string };
+
+// Either vm files to link, or a program precompiled by WebVM.precompile.
+export type Program = { vmFiles: VMFile[] } | { precompiled: Uint8Array };
+
+export type ToWorker =
+  | {
+      type: "load";
+      program: Program;
+      control: SharedArrayBuffer;
+      stats: SharedArrayBuffer;
+      pixels: SharedArrayBuffer;
+    }
+  | { type: "run"; speed: number }
+  | { type: "pause" }
+  | { type: "step"; steps: number }
+  | { type: "reset" }
+  | { type: "debug" };
+
+export type FromWorker =
+  | { type: "ready"; functionNames: string[] }
+  | { type: "error"; message: string }
+  | { type: "debug"; snapshot: Int32Array; nextCommand?: string };
+
+// Slots of the Int32Array over the control buffer. GENERATION counts the
+// frames the worker published to the pixel buffer, and DRAWN is the last one
+// the main thread put on the canvas. The dirty corners cover every pixel that
+// changed since DRAWN, and only ever grow until the main thread catches up,
+// so reading them while the worker writes still gives a rectangle that
+// covers the frame that was read.
+export const GENERATION = 0;
+export const DRAWN = 1;
+export const DIRTY_LEFT = 2;
+export const DIRTY_TOP = 3;
+export const DIRTY_RIGHT = 4;
+export const DIRTY_BOTTOM = 5;
+export const KEYBOARD = 6;
+export const CONTROL_SLOTS = 7;
+
+// Slots of the Float64Array over the stats buffer, written by the worker
+// after every slice.
+export const CYCLES = 0;
+export const STEPS_PER_SECOND = 1;
+export const AVERAGE_SLICE_MS = 2;
+export const MAX_SLICE_MS = 3;
+export const STATS_SLOTS = 4;
+
+export const SCREEN_WIDTH = 512;
+export const SCREEN_HEIGHT = 256;
+export const PIXEL_BYTES = SCREEN_WIDTH * SCREEN_HEIGHT * 4;